@@ -0,0 +1,429 @@
+/* Copyright (c) 2010-2013 by Intel Corp.
+
+   fastwalk is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; version
+   2.
+
+   fastwalk is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should find a copy of v2 of the GNU General Public License somewhere
+   on your Linux system. */
+
+/* The actions that can be run on the file contents. The callbacks are
+   called from several threads at once, each for a different file.
+   The parsed argument belongs to the context, so that contexts with
+   different actions don't share anything. */
+#define _GNU_SOURCE 1
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <limits.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "action.h"
+
+/* grep:REGEX prints the matching lines as path:line */
+
+struct line_carry {		/* a line continued in the next chunk */
+	char *buf;
+	size_t len, max;
+};
+
+static int grep_parse(char *arg, void **argp)
+{
+	regex_t *re;
+	int err;
+
+	if (!arg) {
+		fprintf(stderr, "grep needs a regular expression\n");
+		return -1;
+	}
+	re = malloc(sizeof(regex_t));
+	if (!re) {
+		perror("grep");
+		return -1;
+	}
+	err = regcomp(re, arg, REG_EXTENDED|REG_NEWLINE);
+	if (err) {
+		char msg[200];
+		regerror(err, re, msg, sizeof msg);
+		fprintf(stderr, "grep: %s: %s\n", arg, msg);
+		free(re);
+		return -1;
+	}
+	*argp = re;
+	return 0;
+}
+
+static void grep_free(void *arg)
+{
+	regfree(arg);
+	free(arg);
+}
+
+static void grep_line(struct action_file *f, char *line, size_t len)
+{
+	regmatch_t m = { .rm_so = 0, .rm_eo = len };
+
+	if (regexec(f->arg, line, 1, &m, REG_STARTEND) == 0)
+		printf("%s:%.*s\n", f->path, (int)len, line);
+}
+
+static int grep_open(struct action_file *f)
+{
+	f->priv = calloc(1, sizeof(struct line_carry));
+	if (!f->priv) {
+		perror("grep");
+		return -1;
+	}
+	return 0;
+}
+
+static int carry(struct line_carry *c, char *s, size_t len)
+{
+	if (c->len + len > c->max) {
+		size_t max = (c->len + len) * 2;
+		char *buf = realloc(c->buf, max);
+
+		if (!buf) {
+			perror("grep");
+			return -1;
+		}
+		c->buf = buf;
+		c->max = max;
+	}
+	memcpy(c->buf + c->len, s, len);
+	c->len += len;
+	return 0;
+}
+
+static int grep_data(struct action_file *f, char *buf, size_t len)
+{
+	struct line_carry *c = f->priv;
+	char *p = buf, *end = buf + len, *nl;
+
+	if (c->len) {
+		nl = memchr(p, '\n', len);
+		if (!nl)
+			return carry(c, p, len);
+		if (carry(c, p, nl - p) < 0)
+			return -1;
+		grep_line(f, c->buf, c->len);
+		c->len = 0;
+		p = nl + 1;
+	}
+	while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+		grep_line(f, p, nl - p);
+		p = nl + 1;
+	}
+	return p < end ? carry(c, p, end - p) : 0;
+}
+
+static int grep_close(struct action_file *f)
+{
+	struct line_carry *c = f->priv;
+
+	if (c->len)
+		grep_line(f, c->buf, c->len);
+	free(c->buf);
+	free(c);
+	return 0;
+}
+
+/* sum prints the POSIX cksum CRC, size and path, like cksum(1) */
+
+/* CRC-32 with polynomial 0x04c11db7, most significant bit first */
+static const unsigned crc_table[256] = {
+	0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9,
+	0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
+	0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61,
+	0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd,
+	0x4c11db70, 0x48d0c6c7, 0x4593e01e, 0x4152fda9,
+	0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
+	0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011,
+	0x791d4014, 0x7ddc5da3, 0x709f7b7a, 0x745e66cd,
+	0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039,
+	0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5,
+	0xbe2b5b58, 0xbaea46ef, 0xb7a96036, 0xb3687d81,
+	0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
+	0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49,
+	0xc7361b4c, 0xc3f706fb, 0xceb42022, 0xca753d95,
+	0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1,
+	0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d,
+	0x34867077, 0x30476dc0, 0x3d044b19, 0x39c556ae,
+	0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
+	0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16,
+	0x018aeb13, 0x054bf6a4, 0x0808d07d, 0x0cc9cdca,
+	0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde,
+	0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02,
+	0x5e9f46bf, 0x5a5e5b08, 0x571d7dd1, 0x53dc6066,
+	0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
+	0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e,
+	0xbfa1b04b, 0xbb60adfc, 0xb6238b25, 0xb2e29692,
+	0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6,
+	0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a,
+	0xe0b41de7, 0xe4750050, 0xe9362689, 0xedf73b3e,
+	0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
+	0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686,
+	0xd5b88683, 0xd1799b34, 0xdc3abded, 0xd8fba05a,
+	0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637,
+	0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb,
+	0x4f040d56, 0x4bc510e1, 0x46863638, 0x42472b8f,
+	0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
+	0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47,
+	0x36194d42, 0x32d850f5, 0x3f9b762c, 0x3b5a6b9b,
+	0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff,
+	0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623,
+	0xf12f560e, 0xf5ee4bb9, 0xf8ad6d60, 0xfc6c70d7,
+	0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
+	0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f,
+	0xc423cd6a, 0xc0e2d0dd, 0xcda1f604, 0xc960ebb3,
+	0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7,
+	0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b,
+	0x9b3660c6, 0x9ff77d71, 0x92b45ba8, 0x9675461f,
+	0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
+	0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640,
+	0x4e8ee645, 0x4a4ffbf2, 0x470cdd2b, 0x43cdc09c,
+	0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8,
+	0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24,
+	0x119b4be9, 0x155a565e, 0x18197087, 0x1cd86d30,
+	0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
+	0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088,
+	0x2497d08d, 0x2056cd3a, 0x2d15ebe3, 0x29d4f654,
+	0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0,
+	0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c,
+	0xe3a1cbc1, 0xe760d676, 0xea23f0af, 0xeee2ed18,
+	0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
+	0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0,
+	0x9abc8bd5, 0x9e7d9662, 0x933eb0bb, 0x97ffad0c,
+	0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668,
+	0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4,
+};
+
+static int sum_parse(char *arg, void **argp)
+{
+	if (arg) {
+		fprintf(stderr, "sum takes no argument\n");
+		return -1;
+	}
+	*argp = NULL;
+	return 0;
+}
+
+static int sum_open(struct action_file *f)
+{
+	f->acc = 0;
+	return 0;
+}
+
+static int sum_data(struct action_file *f, char *buf, size_t len)
+{
+	unsigned crc = f->acc;
+	unsigned char *p = (unsigned char *)buf;
+
+	while (len--)
+		crc = (crc << 8) ^ crc_table[(crc >> 24) ^ *p++];
+	f->acc = crc;
+	return 0;
+}
+
+static int sum_close(struct action_file *f)
+{
+	unsigned crc = f->acc;
+	unsigned long long n;
+
+	for (n = f->size; n; n >>= 8)
+		crc = (crc << 8) ^ crc_table[(crc >> 24) ^ (n & 0xff)];
+	printf("%u %llu %s\n", ~crc, f->size, f->path);
+	return 0;
+}
+
+/* copy:DIR copies the files to the same path below DIR as below the
+   directory walked */
+
+/* The argument is the destination, kept by the caller */
+static int copy_parse(char *arg, void **argp)
+{
+	if (!arg || !*arg) {
+		fprintf(stderr, "copy needs a destination directory\n");
+		return -1;
+	}
+	*argp = arg;
+	return 0;
+}
+
+/* In a destination inside a walked tree the copies would overwrite
+   files of the tree that may not have been read yet, as they are
+   copied in disk order. Walks up from the destination, or from its
+   part that exists already, and compares each directory with the
+   roots. */
+static int copy_check(void *arg, char **roots, int numroots)
+{
+	char path[PATH_MAX];
+	struct stat st, up, *rst;
+	char *slash;
+	int i, n = 0, ret = 0;
+
+	if (snprintf(path, sizeof path, "%s", (char *)arg) >= sizeof path) {
+		errno = ENAMETOOLONG;
+		perror(arg);
+		return -1;
+	}
+	while (stat(path, &st) < 0) {
+		slash = strrchr(path, '/');
+		if (!slash || slash == path)
+			strcpy(path, slash ? "/" : ".");
+		else
+			*slash = 0;
+	}
+
+	rst = malloc((numroots + 1) * sizeof(struct stat));
+	if (!rst) {
+		perror("copy");
+		return -1;
+	}
+	for (i = 0; i < numroots; i++)
+		if (stat(roots[i], &rst[n]) == 0)
+			n++;
+	for (;;) {
+		for (i = 0; i < n; i++) {
+			if (rst[i].st_dev == st.st_dev && rst[i].st_ino == st.st_ino) {
+				fprintf(stderr, "copy: %s is inside the tree walked\n",
+					(char *)arg);
+				ret = -1;
+				goto out;
+			}
+		}
+		if (strlen(path) + 4 >= sizeof path)
+			break;
+		strcat(path, "/..");
+		/* The parent of / is / */
+		if (stat(path, &up) < 0 ||
+		    (up.st_dev == st.st_dev && up.st_ino == st.st_ino))
+			break;
+		st = up;
+	}
+out:
+	free(rst);
+	return ret;
+}
+
+static int make_parents(char *path)
+{
+	char *p;
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = 0;
+		if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+	return 0;
+}
+
+/* A .. would leave the destination directory */
+static int has_dotdot(const char *name)
+{
+	const char *p;
+
+	for (p = name; (p = strstr(p, "..")) != NULL; p += 2)
+		if ((p == name || p[-1] == '/') && (p[2] == 0 || p[2] == '/'))
+			return 1;
+	return 0;
+}
+
+static int copy_open(struct action_file *f)
+{
+	char dst[PATH_MAX];
+	struct stat src, st;
+
+	f->outfd = -1;
+	if (!*f->name || has_dotdot(f->name)) {
+		fprintf(stderr, "%s: not copied below %s\n", f->path, 
+			(char *)f->arg);
+		return -1;
+	}
+	if (snprintf(dst, sizeof dst, "%s/%s", (char *)f->arg, f->name) >= sizeof dst) {
+		errno = ENAMETOOLONG;
+		goto fail;
+	}
+	if (make_parents(dst) < 0)
+		goto fail;
+	f->outfd = open(dst, O_WRONLY|O_CREAT, f->mode & 07777);
+	if (f->outfd < 0 || fstat(f->fd, &src) < 0 || fstat(f->outfd, &st) < 0)
+		goto fail;
+	/* Truncating the source itself would lose it */
+	if (src.st_dev == st.st_dev && src.st_ino == st.st_ino) {
+		fprintf(stderr, "%s: is the same file as %s\n", dst, f->path);
+		goto out;
+	}
+	if (ftruncate(f->outfd, 0) == 0)
+		return 0;
+fail:
+	perror(dst);
+out:
+	if (f->outfd >= 0)
+		close(f->outfd);
+	return -1;
+}
+
+static int copy_data(struct action_file *f, char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(f->outfd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(f->arg);
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int copy_close(struct action_file *f)
+{
+	if (close(f->outfd) < 0) {
+		perror(f->arg);
+		return -1;
+	}
+	return 0;
+}
+
+static struct action actions[] = {
+	{ "grep", grep_parse, NULL, grep_open, grep_data, grep_close, grep_free },
+	{ "sum", sum_parse, NULL, sum_open, sum_data, sum_close, NULL },
+	{ "copy", copy_parse, copy_check, copy_open, copy_data, copy_close, NULL },
+};
+
+/* arg is NAME or NAME:ARG. Returns NULL for unknown or bad actions,
+   otherwise argp is to be released with the free of the action. arg
+   must stay valid while the action is used. */
+struct action *action_find(char *arg, void **argp)
+{
+	char *colon = strchr(arg, ':');
+	size_t len = colon ? colon - arg : strlen(arg);
+	int i;
+
+	for (i = 0; i < sizeof(actions) / sizeof(actions[0]); i++) {
+		struct action *a = &actions[i];
+		if (strlen(a->name) != len || strncmp(a->name, arg, len))
+			continue;
+		return a->parse(colon ? colon + 1 : NULL, argp) < 0 ? NULL : a;
+	}
+	return NULL;
+}
@@ -0,0 +1,37 @@
+/* Built-in processing of the file contents (-x), in disk order. */
+#ifndef ACTION_H
+#define ACTION_H 1
+
+#include <stddef.h>
+
+struct action_file {
+	const char *path;
+	const char *name;	/* path below the directory walked */
+	int fd;
+	unsigned long long size;
+	unsigned mode;
+	void *arg;		/* from parse, shared by all files */
+	union {			/* private to the action */
+		void *priv;
+		unsigned long long acc;
+		int outfd;
+	};
+};
+
+/* Each returns 0 or -1 after reporting the error. The data of a file
+   is passed in order, in chunks of any size. parse sets what the
+   callbacks get in f->arg, and free releases it again. check, when
+   set, is called with the directories walked before any file. */
+struct action {
+	const char *name;
+	int (*parse)(char *arg, void **argp);
+	int (*check)(void *arg, char **roots, int numroots);
+	int (*open)(struct action_file *f);
+	int (*data)(struct action_file *f, char *buf, size_t len);
+	int (*close)(struct action_file *f);
+	void (*free)(void *arg);
+};
+
+struct action *action_find(char *arg, void **argp);
+
+#endif
@@ -0,0 +1,225 @@
+/* Copyright (c) 2010-2013 by Intel Corp.
+
+   fastwalk is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; version
+   2.
+
+   fastwalk is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should find a copy of v2 of the GNU General Public License somewhere
+   on your Linux system. */
+
+/* Generate a synthetic directory tree for benchmarking.
+   The shape is depth levels of width sub directories, with files
+   in every directory. File sizes are log uniform between min and max.
+   With fragmentation the files of a directory are written round robin
+   in chunks, syncing after each round, so that the allocator
+   interleaves their blocks. */
+#define _GNU_SOURCE 1
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+
+typedef unsigned long long u64;
+
+enum { WRITE_BUF = 64 * 1024 };
+
+static int depth = 3, width = 4, nfiles = 50;
+static u64 min_size = 512, max_size = 1024 * 1024;
+static u64 chunk;		/* fragment in chunks of this size, 0 for not */
+static u64 seed = 1;
+static char buf[WRITE_BUF];
+static u64 total_files, total_bytes;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: mktree [-dDEPTH] [-wWIDTH] [-nFILES] [-sMIN:MAX] [-fCHUNK] [-rSEED] dir\n"
+			"Generate a tree of DEPTH levels of WIDTH directories with FILES files each\n"
+			"-sMIN:MAX  log uniform file sizes (k, m, g suffixes)\n"
+			"-fCHUNK    fragment the files of a directory by writing them\n"
+			"           interleaved in CHUNK sized pieces\n"
+			"-rSEED     random seed\n");
+	exit(1);
+}
+
+static void die(const char *s)
+{
+	perror(s);
+	exit(1);
+}
+
+/* xorshift64*, so that a seed always gives the same tree */
+static u64 rnd(void)
+{
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 2685821657736338717ULL;
+}
+
+static u64 parse_size(char *arg, char **endp)
+{
+	char *end;
+	u64 n = strtoull(arg, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		n <<= 10;
+		/* FALL THROUGH */
+	case 'm': case 'M':
+		n <<= 10;
+		/* FALL THROUGH */
+	case 'k': case 'K':
+		n <<= 10;
+		end++;
+	}
+	if (end == arg)
+		usage();
+	*endp = end;
+	return n;
+}
+
+static int log2_floor(u64 n)
+{
+	return n ? 63 - __builtin_clzll(n) : 0;
+}
+
+/* Pick a power of two range uniformly, then a size inside it */
+static u64 file_size(void)
+{
+	int lo = log2_floor(min_size), hi = log2_floor(max_size);
+	int k = lo + rnd() % (hi - lo + 1);
+	u64 n = (1ULL << k) + rnd() % (1ULL << k);
+
+	if (n < min_size)
+		n = min_size;
+	if (n > max_size)
+		n = max_size;
+	return n;
+}
+
+static void write_all(int fd, u64 len, const char *name)
+{
+	while (len > 0) {
+		size_t n = len > WRITE_BUF ? WRITE_BUF : len;
+		ssize_t w = write(fd, buf, n);
+
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			die(name);
+		}
+		len -= w;
+	}
+}
+
+static void make_files(const char *dir)
+{
+	char name[PATH_MAX];
+	int fds[nfiles];
+	u64 left[nfiles];
+	int i, busy;
+
+	for (i = 0; i < nfiles; i++) {
+		snprintf(name, sizeof name, "%s/f%d", dir, i);
+		fds[i] = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fds[i] < 0)
+			die(name);
+		left[i] = file_size();
+		total_bytes += left[i];
+		total_files++;
+		if (!chunk) {
+			write_all(fds[i], left[i], name);
+			close(fds[i]);
+		}
+	}
+	if (!chunk)
+		return;
+	do {
+		busy = 0;
+		for (i = 0; i < nfiles; i++) {
+			u64 n = left[i] > chunk ? chunk : left[i];
+
+			if (n == 0)
+				continue;
+			write_all(fds[i], n, dir);
+			left[i] -= n;
+			busy = 1;
+		}
+		/* Force allocation before the next round */
+		if (busy && syncfs(fds[0]) < 0)
+			die(dir);
+	} while (busy);
+	for (i = 0; i < nfiles; i++)
+		close(fds[i]);
+}
+
+static void make_tree(const char *dir, int level)
+{
+	char name[PATH_MAX];
+	int i;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		die(dir);
+	make_files(dir);
+	if (level == depth)
+		return;
+	for (i = 0; i < width; i++) {
+		snprintf(name, sizeof name, "%s/d%d", dir, i);
+		make_tree(name, level + 1);
+	}
+}
+
+int main(int ac, char **av)
+{
+	char *end;
+	int opt, i;
+
+	while ((opt = getopt(ac, av, "d:f:n:r:s:w:")) != -1) {
+		switch (opt) {
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'f':
+			chunk = parse_size(optarg, &end);
+			if (*end || chunk == 0)
+				usage();
+			break;
+		case 'n':
+			nfiles = atoi(optarg);
+			break;
+		case 'r':
+			seed = strtoull(optarg, NULL, 0) | 1;
+			break;
+		case 's':
+			min_size = parse_size(optarg, &end);
+			if (*end++ != ':')
+				usage();
+			max_size = parse_size(end, &end);
+			if (*end || min_size == 0 || max_size < min_size)
+				usage();
+			break;
+		case 'w':
+			width = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != ac - 1 || depth < 0 || width < 1 || nfiles < 1)
+		usage();
+	for (i = 0; i < WRITE_BUF; i++)
+		buf[i] = rnd();
+	make_tree(av[optind], 0);
+	printf("%llu files %llu bytes\n", total_files, total_bytes);
+	return 0;
+}
@@ -0,0 +1,152 @@
+#!/bin/sh
+# Benchmark fastwalk on a synthetic tree with cold caches.
+#
+# Compares reading the whole tree with a naive find | xargs cat
+# against cat in the order of fastwalk, fastwalk -r followed by the
+# cat, and fastwalk -x sum. For each run the wall time, the
+# throughput and the read requests and sectors of the device from
+# /sys/dev/block are recorded, for the fastwalk runs also the -sjson
+# statistics with the seek histogram.
+#
+# Dropping the caches needs root. With -t the tree is put on a fresh
+# loop mounted image of that file system type, which also needs root.
+# Without root the numbers are for a warm cache.
+
+usage() {
+	cat >&2 <<USAGE
+Usage: bench/run.sh [-t ext4|xfs|btrfs] [-S imagesize] [-d dir] [-o resultdir] [-k] [-- mktree options]
+-t FS       create the tree on a loop mounted FS image
+-S SIZE     size of the image (default 4G)
+-d DIR      where to put the tree or image (default /tmp/fastwalk-bench)
+-o DIR      write results.tsv and the statistics there (default DIR/results)
+-k          keep an existing tree instead of generating a new one
+The mktree options set the shape, size distribution and fragmentation,
+see bench/mktree without arguments.
+USAGE
+	exit 1
+}
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+FASTWALK=${FASTWALK:-$top/fastwalk}
+MKTREE=${MKTREE:-$top/bench/mktree}
+fstype=
+imagesize=4G
+dir=/tmp/fastwalk-bench
+out=
+keep=
+
+while getopts t:S:d:o:k opt; do
+	case $opt in
+	t) fstype=$OPTARG ;;
+	S) imagesize=$OPTARG ;;
+	d) dir=$OPTARG ;;
+	o) out=$OPTARG ;;
+	k) keep=1 ;;
+	*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ -n "$out" ] || out=$dir/results
+
+[ -x "$FASTWALK" ] || { echo "$FASTWALK missing, run make" >&2; exit 1; }
+[ -x "$MKTREE" ] || { echo "$MKTREE missing, run make bench" >&2; exit 1; }
+root=
+[ "$(id -u)" = 0 ] && root=1
+
+mnt=
+cleanup() {
+	[ -n "$mnt" ] && umount "$mnt" 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p "$dir" "$out" || exit 1
+tree=$dir/tree
+if [ -n "$fstype" ]; then
+	[ -n "$root" ] || { echo "-t needs root" >&2; exit 1; }
+	image=$dir/$fstype.img
+	mnt=$dir/mnt
+	mkdir -p "$mnt"
+	if [ -z "$keep" ] || [ ! -f "$image" ]; then
+		rm -f "$image"
+		truncate -s "$imagesize" "$image" || exit 1
+		case $fstype in
+		xfs|btrfs) mkfs."$fstype" -q -f "$image" ;;
+		*) mkfs."$fstype" -q -F "$image" ;;
+		esac || exit 1
+		keep=
+	fi
+	mount -o loop "$image" "$mnt" || exit 1
+	tree=$mnt/tree
+fi
+
+if [ -z "$keep" ] || [ ! -d "$tree" ]; then
+	rm -rf "$tree"
+	echo "generating $tree" >&2
+	"$MKTREE" "$@" "$tree" >&2 || exit 1
+fi
+bytes=$(du -sb "$tree" | cut -f1)
+sync
+
+# The stat file of the block device holding the tree:
+# field 1 is reads completed, field 3 sectors read
+devstat=
+dev=$(stat -c %d "$tree")
+major=$((dev >> 8 & 0xfff))
+minor=$((dev & 0xff | (dev >> 12 & 0xfff00)))
+[ -r /sys/dev/block/$major:$minor/stat ] && devstat=/sys/dev/block/$major:$minor/stat
+[ -n "$devstat" ] || echo "no block device statistics for the tree" >&2
+
+warned=
+drop_caches() {
+	sync
+	if [ -n "$root" ] && [ -w /proc/sys/vm/drop_caches ]; then
+		echo 3 > /proc/sys/vm/drop_caches
+	elif [ -z "$warned" ]; then
+		echo "cannot drop caches, results are for a warm cache" >&2
+		warned=1
+	fi
+}
+
+reads() {
+	if [ -n "$devstat" ]; then
+		awk '{ print $1, $3 }' "$devstat"
+	else
+		echo 0 0
+	fi
+}
+
+now() {
+	date +%s.%N
+}
+
+# run NAME COMMAND: time COMMAND in the tree directory with cold caches
+run() {
+	name=$1
+	shift
+	drop_caches
+	set -- $(reads) "$@"
+	r0=$1 s0=$2
+	shift 2
+	start=$(now)
+	(cd "$tree" && eval "$*") > /dev/null 2> "$out/$name.err"
+	status=$?
+	end=$(now)
+	set -- $(reads)
+	awk -v n="$name" -v a="$start" -v b="$end" -v bytes="$bytes" \
+	    -v r=$(($1 - r0)) -v s=$(($2 - s0)) -v st=$status \
+	    'BEGIN { t = b - a; mbs = t > 0 ? bytes / t / 1048576 : 0;
+		     printf "%s\t%.3f\t%.1f\t%d\t%d\t%d\n", n, t, mbs,
+			    r, s, st }' |
+		tee -a "$out/results.tsv"
+}
+
+all='find . -type f -print0 | xargs -0 cat'
+
+echo "# $(uname -r) $fstype $bytes bytes, mktree $*" > "$out/results.tsv"
+printf "name\tseconds\tMB/s\treads\tsectors\tstatus\n" | tee -a "$out/results.tsv"
+run find-cat "$all"
+run fastwalk-list "$FASTWALK -sjson . 2> $out/fastwalk-list.json"
+run fastwalk-cat "$FASTWALK -0 -sjson . 2> $out/fastwalk-cat.json | xargs -0 cat"
+run fastwalk-r "$FASTWALK -r -sjson . 2> $out/fastwalk-r.json; $all"
+run fastwalk-ru "$FASTWALK -r -u -sjson . 2> $out/fastwalk-ru.json; $all"
+run fastwalk-x "$FASTWALK -x sum -sjson . 2> $out/fastwalk-x.json"
@@ -0,0 +1,210 @@
+/* Copyright (c) 2010-2013 by Intel Corp.
+
+   fastwalk is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; version
+   2.
+
+   fastwalk is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should find a copy of v2 of the GNU General Public License somewhere
+   on your Linux system. */
+
+/* The cache file is the header followed by the file, extent, 
+   directory and directory children arrays and the name blob, in 
+   native byte order. It is mapped read only and used in place, 
+   files and directories are found by binary search. */
+#define _GNU_SOURCE 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "cache.h"
+
+/* Check that all indexes stay inside the mapping. */
+static int cache_valid(struct cache *c)
+{
+	struct cache_header *h = c->hdr;
+	unsigned i;
+
+	for (i = 0; i < h->numfiles; i++)
+		if ((unsigned long long)c->files[i].extent + 
+		    c->files[i].numextents > h->numextents)
+			return 0;
+	for (i = 0; i < h->numdirs; i++)
+		if ((unsigned long long)c->dirs[i].child + 
+		    c->dirs[i].numchildren > h->numchildren)
+			return 0;
+	for (i = 0; i < h->numchildren; i++)
+		if (c->children[i].name >= h->namesize)
+			return 0;
+	return h->namesize == 0 || c->names[h->namesize - 1] == 0;
+}
+
+/* Returns 0 when a valid cache was mapped, otherwise -1 */
+int cache_load(struct cache *c, const char *path)
+{
+	struct cache_header *h;
+	struct stat st;
+	size_t need;
+	int fd;
+
+	memset(c, 0, sizeof(struct cache));
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct cache_header)) {
+		close(fd);
+		return -1;
+	}
+	c->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (c->map == MAP_FAILED) {
+		c->map = NULL;
+		return -1;
+	}
+	c->len = st.st_size;
+
+	h = c->map;
+	need = sizeof(struct cache_header) + 
+		(size_t)h->numfiles * sizeof(struct cache_file) +
+		(size_t)h->numextents * sizeof(struct cache_extent) +
+		(size_t)h->numdirs * sizeof(struct cache_dir) +
+		(size_t)h->numchildren * sizeof(struct cache_child) +
+		h->namesize;
+	if (memcmp(h->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) || 
+	    h->version != CACHE_VERSION || need != c->len)
+		goto invalid;
+	c->hdr = h;
+	c->files = (struct cache_file *)(h + 1);
+	c->extents = (struct cache_extent *)(c->files + h->numfiles);
+	c->dirs = (struct cache_dir *)(c->extents + h->numextents);
+	c->children = (struct cache_child *)(c->dirs + h->numdirs);
+	c->names = (char *)(c->children + h->numchildren);
+	if (!cache_valid(c))
+		goto invalid;
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s: invalid cache file ignored\n", path);
+	cache_close(c);
+	return -1;
+}
+
+void cache_close(struct cache *c)
+{
+	if (c->map)
+		munmap(c->map, c->len);
+	memset(c, 0, sizeof(struct cache));
+}
+
+struct cache_file *cache_lookup(struct cache *c, unsigned long long dev,
+				unsigned long long ino)
+{
+	size_t lo = 0, hi;
+
+	if (!c->hdr)
+		return NULL;
+	hi = c->hdr->numfiles;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		struct cache_file *f = &c->files[mid];
+		if (f->dev < dev || (f->dev == dev && f->ino < ino))
+			lo = mid + 1;
+		else if (f->dev == dev && f->ino == ino)
+			return f;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+struct cache_dir *cache_lookup_dir(struct cache *c, unsigned long long dev,
+				   unsigned long long ino)
+{
+	size_t lo = 0, hi;
+
+	if (!c->hdr)
+		return NULL;
+	hi = c->hdr->numdirs;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		struct cache_dir *d = &c->dirs[mid];
+		if (d->dev < dev || (d->dev == dev && d->ino < ino))
+			lo = mid + 1;
+		else if (d->dev == dev && d->ino == ino)
+			return d;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Write to a temporary file and rename, so that a mapped old cache
+   stays valid and readers never see a partial file. 
+   Returns 0 or -1 with errno set. */
+int cache_write(const char *path, struct cache_header *hdr,
+		struct cache_file *files, struct cache_extent *extents,
+		struct cache_dir *dirs, struct cache_child *children,
+		char *names)
+{
+	char *tmp;
+	int fd, err;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+		return -1;
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		free(tmp);
+		return -1;
+	}
+	memcpy(hdr->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	hdr->version = CACHE_VERSION;
+	if (write_all(fd, hdr, sizeof(struct cache_header)) ||
+	    write_all(fd, files, hdr->numfiles * sizeof(struct cache_file)) ||
+	    write_all(fd, extents, 
+		      hdr->numextents * sizeof(struct cache_extent)) ||
+	    write_all(fd, dirs, hdr->numdirs * sizeof(struct cache_dir)) ||
+	    write_all(fd, children, 
+		      hdr->numchildren * sizeof(struct cache_child)) ||
+	    write_all(fd, names, hdr->namesize)) {
+		err = errno;
+		close(fd);
+		goto fail;
+	}
+	if (close(fd) < 0 || rename(tmp, path) < 0) {
+		err = errno;
+		goto fail;
+	}
+	free(tmp);
+	return 0;
+
+fail:
+	unlink(tmp);
+	free(tmp);
+	errno = err;
+	return -1;
+}
@@ -0,0 +1,81 @@
+/* On disk cache of the disk order of files, from a previous run. */
+#ifndef CACHE_H
+#define CACHE_H 1
+
+#include <stddef.h>
+
+#define CACHE_MAGIC "FWCACHE"
+
+enum {
+	CACHE_VERSION = 2,
+	CACHE_FULL = 1 << 0,	/* all extents, not only the first */
+};
+
+struct cache_header {
+	char magic[8];
+	unsigned version;
+	unsigned flags;
+	unsigned numfiles;
+	unsigned numextents;
+	unsigned numdirs;
+	unsigned numchildren;
+	unsigned long long skiphash;	/* of the skip list used */
+	unsigned long long namesize;
+};
+
+/* Sorted by dev and ino */
+struct cache_file {
+	unsigned long long dev;
+	unsigned long long ino;
+	unsigned long long mtime;	/* ns */
+	unsigned long long size;
+	unsigned extent;		/* first extent */
+	unsigned numextents;
+};
+
+struct cache_extent {
+	unsigned long long disk;
+	unsigned long long offset;
+	unsigned len;
+	unsigned pad;
+};
+
+/* Sorted by dev and ino */
+struct cache_dir {
+	unsigned long long dev;
+	unsigned long long ino;
+	unsigned long long mtime;	/* ns */
+	unsigned long long ctime;	/* ns */
+	unsigned child;			/* first child */
+	unsigned numchildren;
+};
+
+struct cache_child {
+	unsigned long long ino;
+	unsigned name;			/* offset in names */
+	unsigned type;			/* DT_* */
+};
+
+struct cache {
+	void *map;
+	size_t len;
+	struct cache_header *hdr;
+	struct cache_file *files;
+	struct cache_extent *extents;
+	struct cache_dir *dirs;
+	struct cache_child *children;
+	char *names;
+};
+
+int cache_load(struct cache *c, const char *path);
+void cache_close(struct cache *c);
+struct cache_file *cache_lookup(struct cache *c, unsigned long long dev,
+				unsigned long long ino);
+struct cache_dir *cache_lookup_dir(struct cache *c, unsigned long long dev,
+				   unsigned long long ino);
+int cache_write(const char *path, struct cache_header *hdr,
+		struct cache_file *files, struct cache_extent *extents,
+		struct cache_dir *dirs, struct cache_child *children,
+		char *names);
+
+#endif
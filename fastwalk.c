@@ -18,7 +18,7 @@
 
 /* Print list of files for directory trees in disk order of data on disk.
    Is careful to minimize seeks during operation, at the cost of some
-   more CPU time. 
+   more CPU time.
 
    The file list can be processed by a program that reads the file data
    with minimum seeks.
@@ -26,511 +26,176 @@
    Alternatively it can just start readaheads
   */
 #define _GNU_SOURCE 1
-#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stddef.h>
-#include <sys/stat.h>
-#include <sys/ioctl.h>
-#include <linux/fs.h>
-#include <linux/fiemap.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
-#include <alloca.h>
-#include <string.h>
-#include <fcntl.h>
-#include <assert.h>
-#include <sys/resource.h>
-#include "list.h"
+#include "fastwalk.h"
+#include "stats.h"
 
 typedef unsigned long long u64;
 
-struct fd;
-
-struct entry { 
-	ino_t ino;
-	dev_t dev;
-	unsigned type;
-	char *name;
-	union {
-		struct fd *fd;
-		u64 disk;
-	};
-	int numextents;
+enum {
+	OUTPUT_BUF = 1024 * 1024, /* stdout buffer when not a tty */
 };
 
-enum { 
-	START_SIZE = (64 * 4096)/sizeof(struct entry),
-	EXTENTS_START = 4096,
-};
+enum { FMT_NAMES, FMT_TSV, FMT_BIN };
+static int format = FMT_NAMES;	/* output format (-F) */
+static int separator = '\n';	/* after each record, NUL with -0 */
 
-struct extent {
-	u64 disk;
-	u64 offset;
-	u64 len;
-	struct entry *entry;
-};
+static int stats_json;		/* -sjson */
 
-struct fd { 
-	struct entry *entry;
-	struct list_head lru;
-	int fd;
+/* Record of the bin format, followed by namelen bytes of path */
+struct bin_record {
+	u64 dev;
+	u64 ino;
+	u64 size;
+	u64 disk;
+	unsigned numextents;
+	unsigned namelen;
 };
 
-static struct entry *entries;
-static int maxentries, numentries;
-
-static struct extent *extents;
-static int maxextents, numextents;
-
-int error;
-
-int debug;
-
-int do_readahead;
-
-#define Perror(x) (perror(x),error = 1)
-
-static void oom(void)
-{
-	fprintf(stderr, "Out of memory\n");
-	exit(ENOMEM);
-}
-
-static void *xrealloc(void *ptr, unsigned n)
-{
-	void *p = realloc(ptr, n);
-	if (!p) oom();
-	return p;
-}
-
-static void *xmalloc(unsigned n)
-{
-	void *p = malloc(n);
-	if (!p) oom();
-	return p;
-}
-
-static struct entry *getentry(void)
-{
-	struct entry *e;
-	if (numentries >= maxentries) {
-		if (maxentries == 0)
-			maxentries = START_SIZE;
-		else
-			maxentries *= 2;
-		entries = xrealloc(entries, maxentries * sizeof(struct entry));
-	}
-	e = &entries[numentries++];
-	memset(e, 0, sizeof(struct entry));
-	return e;
-}
-
-static int doskip(char *name, char **skip, int skipcnt)
-{
-	int k;
-
-	for (k = 0; k < skipcnt; k++) {
-		if (!strcmp(name, skip[k]))
-			return 1;
+static int output_file(const struct fastwalk_file *f, void *arg)
+{
+	struct bin_record rec;
+
+	switch (format) {
+	case FMT_NAMES:
+		fputs_unlocked(f->path, stdout);
+		putc_unlocked(separator, stdout);
+		break;
+	case FMT_TSV:
+		printf("%llu\t%llu\t%llu\t%llu\t%u\t%s%c",
+		       (u64)f->dev, (u64)f->ino, f->size, f->disk,
+		       f->numextents, f->path, separator);
+		break;
+	case FMT_BIN:
+		rec.dev = f->dev;
+		rec.ino = f->ino;
+		rec.size = f->size;
+		rec.disk = f->disk;
+		rec.numextents = f->numextents;
+		rec.namelen = strlen(f->path);
+		fwrite_unlocked(&rec, sizeof(struct bin_record), 1, stdout);
+		fwrite_unlocked(f->path, rec.namelen, 1, stdout);
+		break;
 	}
 	return 0;
 }
 
-static int walk(char *dir, char **skip, int skipcnt)
-{
-	int found_unknown = 0;
-	struct stat st;
-	int fd = open(dir, O_RDONLY|O_DIRECTORY);
-	if (fd < 0) { 
-		Perror(dir);
-		return 0;
-	}
-	if (fstat(fd, &st) < 0) { 
-		Perror(dir);
-		close(fd);
-		return found_unknown;
-	}
-
-	DIR *d = fdopendir(fd);
-	
-	struct dirent *de;
-	de = alloca(offsetof(struct dirent, d_name) + 
-		    pathconf(dir, _PC_NAME_MAX) + 1); 
-	while (readdir_r(d, de, &de) == 0 && de) { 
-		char *name;
-
-		if (asprintf(&name, "%s/%s", dir, de->d_name) < 0) 
-			oom();
-
-		if (doskip(de->d_name, skip, skipcnt))
-			continue;
-
-		if (de->d_type == DT_DIR) { 
-			if (walk(name, skip, skipcnt))
-				found_unknown = 1;
-			free(name);
-		} else {
-			struct entry *e = getentry(); 
-
-			e->type = de->d_type;
-			e->ino = de->d_ino;
-			e->dev = st.st_dev;
-			e->name = name;
-
-			if (e->type == DT_UNKNOWN) {
-				found_unknown = 1;
-				if (debug)
-					fprintf(stderr, "%s: DT_UNKNOWN\n", name);
-			}
-		}
-	} 
-		
-	closedir(d);
-	return found_unknown;
-}
-
-static int cmp_entry_ino(const void *av, const void *bv)
-{
-	const struct entry *a = av;
-	const struct entry *b = bv;
-	return a->ino - b->ino;
-}
-
-static int cmp_entry_disk(const void *av, const void *bv)
-{
-	const struct entry *a = av;
-	const struct entry *b = bv;
-	return a->disk - b->disk;
-}
-
-static int cmp_extent(const void *av, const void *bv)
-{
-	const struct extent *a = av;
-	const struct extent *b = bv;
-	return a->disk - b->disk;
-}
-
-static void sort_inodes(void)
-{
-	qsort(entries, numentries, sizeof(struct entry), cmp_entry_ino);
-}
-
-/* Sort entry by disk order. Only for the first extent */
-static void sort_entries_disk(void)
-{
-	int i;
-	for (i = 0; i < numextents; i++)
-		extents[i].entry->disk = extents[i].disk;
-	qsort(entries, numentries, sizeof(struct entry), cmp_entry_disk);
-}
-
-/* Sort extents by disk order */
-static void sort_extents(void)
-{
-	qsort(extents, numextents, sizeof(struct extent), cmp_extent);
-}
-
-static void handle_unknown(char **skip, int skipcnt)
-{
-	int i, start, max, found_unknown;
-
-	fprintf(stderr, "Warning: file system does not support dt_type\n");
- 
-	found_unknown = 0;
-	start = 0;
-	for (;;) { 
-		max = numentries;
-		for (i = start; i < max; i++) {
-			struct stat st;
-
-			if (entries[i].type != DT_UNKNOWN)
-				continue;
-			if (stat(entries[i].name, &st) < 0) {
-				Perror(entries[i].name); 
-				continue;
-			}
-			if (S_ISDIR(st.st_mode) && walk(entries[i].name, 
-							skip, skipcnt))
-				found_unknown = 1;
-		}
-
-		if (!found_unknown) 
-			break;
-		
-		sort_inodes();
-		start = max;
-	} 
-}
-
-static struct extent *get_extents(int num)
-{
-	struct extent *e;
-	
-	while (numextents + num > maxextents) { 
-		if (maxextents == 0)
-			maxextents = EXTENTS_START;
-		maxextents *= 2;
-		extents = xrealloc(extents, maxextents * sizeof(struct extent));
-	}
-	e = extents + numextents;
-	numextents += num;
-	return e;
-}
-
-static void save_extents(struct fiemap *fie, struct entry *entry)
-{
-	struct extent *e;
-	int i;
-	int num = do_readahead ? fie->fm_mapped_extents : 1; 
-
-	e = get_extents(num);
-	for (i = 0; i < num; i++, e++) { 
-		if (fie->fm_extents[i].fe_flags & FIEMAP_EXTENT_UNKNOWN) {
-			memset(e, 0, sizeof(struct extent));
-			e->entry = entry;
-			continue;
-		}
-		e->disk = fie->fm_extents[i].fe_physical;
-		e->offset = fie->fm_extents[i].fe_logical;
-		e->len = fie->fm_extents[i].fe_length;
-		e->entry = entry;
-	}
-	entry->numextents = num;
-}
-
-static void get_disk(char *name, int fd, struct entry *entry)
-{
-	u64 disk;
-	static int once;
-	const int N = 100;
-	struct fiemap *fie = alloca(sizeof(struct fiemap) + 
-				    sizeof(struct fiemap_extent)*N);
-	struct stat st;
-
-	if (stat(name, &st) < 0) { 
-		Perror(name);
-		return;
-	}
-
-	memset(fie, 0, sizeof(struct fiemap));
-	fie->fm_extent_count = N;
-	fie->fm_start = 0;
-	fie->fm_length = st.st_size;
-	
-	/* If the extents have out of inode contents we will seek here.
-	   No way to avoid that currently */
-
-	if (ioctl(fd, FS_IOC_FIEMAP, fie) >= 0) {
-		if (fie->fm_flags & FIEMAP_EXTENT_UNKNOWN) { 
-			if (!once)
-				fprintf(stderr, "%s: Disk location unknown\n", name); 
-			once = 1;
-		}
-		save_extents(fie, entry);
-		return;
-	}
-	
-	if (ioctl(fd, FIBMAP, &disk) < 0) {
-		if (errno == EPERM) {
-			if (!once) 
-				fprintf(stderr, 
-					"%s: No FIEMAP and no root: no disk data sorting\n", name);
-			once = 1;
-		}
-		memset(fie, 0, 
-		       sizeof(struct fiemap) + sizeof(struct fiemap_extent));
-		fie->fm_mapped_extents = 1;
-		fie->fm_extents[0].fe_physical = st.st_size;
-		save_extents(fie, entry);
-	}
-}
-
-/* LRU for file descriptors */
-
-static LIST_HEAD(lru);
-static struct fd *fds;
-static int free_fd, max_fd;
-
-static int list_len(struct list_head *h, int *freep)
-{
-	struct list_head *l;
-	int i = 0;
-	*freep = 0;
-	list_for_each (l, h) {
-		struct fd *fd = list_entry(l, struct fd, lru);
-		if (!fd->entry) (*freep)++;
-		i++;
-	}
-	return i;
-}
-
-static void log_lru(void)
-{
-	static FILE *f; 
-	int fl = 0;
-	if (!f) f = fopen("/tmp/lru", "w");
-	int len = list_len(&lru, &fl);
-	fprintf(f, "%d %d\n", len, fl);
-}
-
-static void init_fd(void)
-{
-	struct rlimit rlim;
-	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0)
-		rlim.rlim_cur = 100;
-	max_fd = rlim.rlim_cur;
-	max_fd -= max_fd / 10; /* save 10% for safety */
-	fds = xmalloc(sizeof(struct fd) * max_fd);
-}
-
-static void do_close_fd(struct fd *fd)
-{
-	close(fd->fd);
-	fd->entry->fd = NULL;
-	fd->entry = NULL;
-}
-
-static struct fd *get_unused_fd(void)
-{
-	struct fd *fd;
-	if (free_fd < max_fd)
-		return &fds[free_fd++];
-	assert(!list_empty(&lru));
-	fd = list_entry(lru.prev, struct fd, lru);
-	list_del(&fd->lru);
-	if (fd->entry)
-		do_close_fd(fd);
-	return fd;
-}
-
-static struct fd *get_fd(struct entry *e)
-{
-	struct fd *fd = e->fd;
-	if (fd) {
-		list_del(&fd->lru);
-	} else {
-		fd = get_unused_fd();
-		fd->fd = open(e->name, O_RDONLY);
-		if (fd->fd < 0) { 
-			list_add_tail(&fd->lru, &lru);
-			return NULL;
-		} else { 
-			e->fd = fd;
-		}
-		fd->entry = e;
-	}
-	list_add(&fd->lru, &lru);
-	return fd;
-}
-
-static void close_fd(struct fd *fd)
-{
-	do_close_fd(fd);
-	list_del(&fd->lru);
-	list_add_tail(&fd->lru, &lru);
-}
-
 static void usage(void)
 {
-	fprintf(stderr, "Usage: fastwalk [-pSKIP] [-r]\n"
+	fprintf(stderr, "Usage: fastwalk [-pSKIP] [-eGLOB] [-IGLOB] [-zMIN:MAX] [-PCLASS:GLOB] [-HLIST [-GN]] [-r|-R [-gGAP] [-mMAX] [-wWINDOW [-fLIST]]] [-xACTION] [-0] [-FFORMAT] [-s[json]] [-D] [-u] [-j[PATH=]N] [-nFDS] [-cCACHE [-i]] [-bN]\n"
 			"Generate list of files in (approx) logical disk order to minimize seeks.\n"
 			"By default a list of names is generated, that can be\n"
 		       	"read by another program\n"
 			"\n"
 			"-pSKIP skip files/directories named SKIP\n"
-			"-r     read ahead files instead of outputting name\n");
+			"-eGLOB skip files/directories matching GLOB\n"
+			"-IGLOB only files matching GLOB (several allowed)\n"
+			"-zMIN:MAX  only files of MIN to MAX bytes, either may be empty\n"
+			"-PCLASS:GLOB[,GLOB]  read files matching GLOB in CLASS -7..7,\n"
+			"          lower first, others are 0\n"
+			"-HLIST read the files in the order of LIST first, in disk\n"
+			"       order within batches of -GN files (default 1024)\n"
+			"-cCACHE  reuse and update disk order cache file CACHE\n"
+			"-i     don't reread unchanged directories from the cache\n"
+			"-bN    stream: process files in batches of N during the walk\n"
+			"-jN    keep N metadata requests in flight per device (default from sysfs)\n"
+			"-jPATH=N  same for the device of PATH only\n"
+			"-nFDS  use at most FDS file descriptors (default from ulimit -n)\n"
+			"-r     read ahead files instead of outputting name\n"
+			"-R     like -r, but read the data and only exit once it is\n"
+			"       in the page cache, -s reports how much stayed there\n"
+			"-gGAP  submit reads less than GAP bytes apart on disk together\n"
+			"-mMAX  read ahead at most MAX bytes, or MAX%% of available memory\n"
+			"-wWINDOW  stay at most WINDOW bytes ahead of the consumer\n"
+			"-fLIST    consumer reports read files in LIST (- for stdin),\n"
+			"          default fanotify\n"
+			"-xACTION  read the files in disk order and run ACTION on them:\n"
+			"          grep:REGEX print matching lines, sum print cksum(1)\n"
+			"          checksums, copy:DIR copy the files below DIR\n"
+			"-0     end the names with NUL instead of newline\n"
+			"-FFORMAT  output names (default), tsv of device, inode,\n"
+			"          size, disk offset, extents and name, or bin records\n"
+			"-s     print statistics on stderr at the end, -sjson as JSON\n"
+			"-D     read the directories in the disk order of their blocks\n"
+			"-u     batch system calls with io_uring if available\n");
 	exit(1);
 }
 
 int main(int ac, char **av)
 {
-	int i;
-	int found_unknown = 0;
-	int opt;
-	char *skip[ac + 2];
-	int skipcnt = 0;
+	struct fastwalk *fw;
+	char seen[128] = { 0 };
+	int i, opt, ret;
 
-	skip[skipcnt++] = ".";
-	skip[skipcnt++] = "..";
-	while ((opt = getopt(ac, av, "p:r")) != -1) {
-		switch (opt) { 
-		case 'p':
-			skip[skipcnt++] = optarg;
+	/* The options are checked before the context exists, which
+	   needs to know the output format */
+	while ((opt = getopt(ac, av, "0b:c:De:dF:f:G:g:H:I:ij:m:n:P:p:Rrs::uw:x:z:")) != -1) {
+		switch (opt) {
+		case '0':
+			separator = 0;
+			break;
+		case 'F':
+			if (!strcmp(optarg, "tsv"))
+				format = FMT_TSV;
+			else if (!strcmp(optarg, "bin"))
+				format = FMT_BIN;
+			else if (strcmp(optarg, "names"))
+				usage();
 			break;
-		case 'r':
-			do_readahead = 1;
+		case 's':
+			stats_on = 1;
+			if (optarg && !strcmp(optarg, "json"))
+				stats_json = 1;
+			else if (optarg)
+				usage();
 			break;
-		case 'd':
-			debug++;
+		case 'R':
+			seen['r'] = 1;
 			break;
-		default:
+		case '?':
 			usage();
 		}
+		seen[opt] = 1;
 	}
-
-	/* First pass: read directories */
-	if (optind == ac) {
-		walk(".", skip, skipcnt);
-	} else { 
-		for (i = optind; i < ac; i++) { 
-			if (walk(av[i], skip, skipcnt))
-				found_unknown = 1;
-		}
-	}
-
-	/* Inode sort for fast stat */
-	sort_inodes();
-	
-	/* For DT_UNKNOWN file systems complete the tree */
-	if (found_unknown)
-		handle_unknown(skip, skipcnt);
-
-	/* Second pass: Get disk addresses: reads inodes and extents.
-	   The extent reading is not necessarily in disk order
-	   because the kernel doesn't give us this currently. 
-	   But it should work for the common case of the extents
-	   (or indirect blocks) being inlined into the inode. */
-	for (i = 0; i < numentries; i++) {
-		int fd;
-		if (entries[i].type != DT_REG)
+	if ((seen['i'] && !seen['c']) || (seen['b'] && seen['c']) ||
+	    (seen['w'] && !seen['r']) || (seen['f'] && !seen['w']) ||
+	    (seen['x'] && seen['r']) || (seen['G'] && !seen['H']) ||
+	    ((format != FMT_NAMES || !separator) && (seen['r'] || seen['x'])))
+		usage();
+
+	fw = fastwalk_new(format != FMT_NAMES ? FASTWALK_INFO : 0);
+	optind = 1;
+	while ((opt = getopt(ac, av, "0b:c:De:dF:f:G:g:H:I:ij:m:n:P:p:Rrs::uw:x:z:")) != -1) {
+		if (strchr("0Fs", opt))
 			continue;
-		fd = open(entries[i].name, O_RDONLY);
-		if (fd >= 0) {
-			get_disk(entries[i].name, fd, &entries[i]);
-			close(fd);
-		} else {
-			Perror(entries[i].name);
+		if (fastwalk_option(fw, opt, optarg) < 0) {
+			if (errno == EINVAL)
+				usage();
+			exit(1);
 		}
 	}
+	fastwalk_callbacks(fw, output_file, NULL, NULL);
 
-	if (do_readahead) {
-		init_fd();
-		
-		sort_extents();
-
-		/* Third pass: read the data in disk order */
-		for (i = 0; i < numextents; i++) {
-			struct extent *ex = &extents[i];
-			struct entry *e = ex->entry;
-			struct fd *fd = get_fd(e);
-
-			if (debug > 0)	
-				log_lru();
-			if (!fd) { 
-				Perror(e->name);
-				continue;
-			}
-			readahead(fd->fd, ex->offset, ex->len);
-			if (--e->numextents == 0)
-				close_fd(fd);
-		}
+	if (!isatty(1))
+		setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUF);
+	if (optind == ac) {
+		fastwalk_add(fw, ".");
 	} else {
-		sort_entries_disk();
-
-		for (i = 0; i < numentries; i++)
-			puts(entries[i].name);
+		for (i = optind; i < ac; i++)
+			fastwalk_add(fw, av[i]);
 	}
+	ret = fastwalk_walk(fw);
+	ret |= fastwalk_iterate(fw);
 
-	return error;
+	if (fflush(stdout) != 0) {
+		perror("stdout");
+		ret = -1;
+	}
+	stats_print(stats_json);
+	fastwalk_free(fw);
+	return ret != 0;
 }
@@ -0,0 +1,114 @@
+/* libfastwalk: walk directory trees and get their files in the order
+   of their data on disk, in process.
+
+   A context walks the trees added to it, gets the disk addresses of
+   the files and sorts them, then passes them in disk order to the
+   callbacks, or reads them ahead or runs an action on their contents
+   like the command line tool. Contexts can be used from different
+   threads, but a single context must only be used by one thread at a
+   time. Each context sizes its file descriptors from RLIMIT_NOFILE,
+   so contexts that walk at the same time must split it between them
+   with option n. The calls print the errors of single files on
+   stderr and go on. When memory runs out the process exits. The statistics of -s are per process.
+
+   The strings and structures passed to the callbacks are only valid
+   during the call. */
+#ifndef FASTWALK_H
+#define FASTWALK_H 1
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+	FASTWALK_INFO = 1 << 0,	/* fill in size, disk and numextents */
+	FASTWALK_REPEAT = 1 << 1, /* keep cached files for fastwalk_rewind() */
+};
+
+struct fastwalk;
+
+struct fastwalk_file {
+	const char *path;
+	dev_t dev;
+	ino_t ino;
+	/* Only with FASTWALK_INFO, otherwise 0 */
+	unsigned long long size;
+	unsigned long long disk;	/* of the first extent, 0 when unknown */
+	unsigned numextents;
+};
+
+struct fastwalk_extent {
+	unsigned long long disk;
+	unsigned long long offset;	/* in the file */
+	unsigned len;
+};
+
+/* A nonzero return value stops the iteration and is returned by
+   the call that iterated. */
+typedef int (*fastwalk_file_fn)(const struct fastwalk_file *f, void *arg);
+typedef int (*fastwalk_extent_fn)(const struct fastwalk_file *f,
+				  const struct fastwalk_extent *x, void *arg);
+typedef int (*fastwalk_dir_fn)(const char *path, void *arg);
+
+struct fastwalk *fastwalk_new(int flags);
+void fastwalk_free(struct fastwalk *fw);
+
+/* Set an option of fastwalk(1), by its letter and with its argument:
+   b c D d e f G g H I i j m n P p R r u w x z. The restrictions on combining them
+   are the same. Returns 0, or -1 with errno EINVAL for a bad
+   argument or another errno when it could not be used. */
+int fastwalk_option(struct fastwalk *fw, int opt, const char *arg);
+
+/* Called in disk order by fastwalk_iterate(). With extent_fn the
+   extents of all files are passed sorted by disk instead, and file_fn
+   is not used. Empty files and extents whose location is not known
+   have no extents. Neither is called with readahead (r, R) or an
+   action (x). Must be set before fastwalk_walk() for streaming (b). */
+void fastwalk_callbacks(struct fastwalk *fw, fastwalk_file_fn file_fn,
+			fastwalk_extent_fn extent_fn, void *arg);
+
+/* Called by the walk for each directory before it is read. */
+void fastwalk_dir_callback(struct fastwalk *fw, fastwalk_dir_fn dir_fn, 
+			   void *arg);
+
+/* Add a directory tree to walk. */
+int fastwalk_add(struct fastwalk *fw, const char *dir);
+
+/* Read the directories of the trees added since the last walk.
+   In streaming mode the batches are also sorted and iterated.
+   Returns 0, -1 when some could not be read or with errno EINVAL
+   for options that cannot be combined, or the return value of a
+   callback that stopped it. */
+int fastwalk_walk(struct fastwalk *fw);
+
+/* Get the disk addresses of the files found since the last
+   iteration and sort them. Returns 0 or -1 like fastwalk_walk(). */
+int fastwalk_sort(struct fastwalk *fw);
+
+/* Sort if that was not done yet, then pass the files to the
+   callbacks in disk order, or read them ahead or process them.
+   Afterwards the next walk only adds new files. Returns like
+   fastwalk_walk(). */
+int fastwalk_iterate(struct fastwalk *fw);
+
+/* Make the next fastwalk_iterate() pass all files found so far once
+   more in the same order, without walking or sorting them again.
+   Only after fastwalk_sort() and not in streaming mode. The readahead
+   normally leaves out the files that were cached during the sort,
+   with FASTWALK_REPEAT it reads them too, as they may have been
+   evicted since. The errors of the earlier calls are forgotten, so
+   the next iteration only reports its own. */
+void fastwalk_rewind(struct fastwalk *fw);
+
+/* With populate (R) the iteration returns once the data is read.
+   Returns how many of the bytes read were in the page cache right
+   after their read, since fastwalk_new() or the last rewind. */
+unsigned long long fastwalk_populated(struct fastwalk *fw);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
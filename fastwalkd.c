@@ -0,0 +1,600 @@
+/* Copyright (c) 2010-2013 by Intel Corp.
+
+   fastwalk is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; version
+   2.
+
+   fastwalk is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should find a copy of v2 of the GNU General Public License somewhere
+   on your Linux system. */
+
+/* Keep the disk order of directory trees in memory and read them
+   ahead on request, so that repeated prefetches of the same tree
+   only pay for the readahead pass.
+
+   Each tree has a context with its sorted extents and an inotify
+   instance watching all its directories, which are added by the walk
+   just before each directory is read. Any change to the tree stops
+   the watching, and the next request for it walks it again. Requests
+   are lines of "prefetch PATH" on a Unix socket, answered with "ok"
+   or "error" once the readahead was submitted. With -R the answer
+   comes once the data is read, as "ok BYTES" with the bytes that
+   made it into the page cache.
+
+   Each prefetch runs in a thread of its own, so that the poll loop
+   keeps serving the other clients. Its client is not read until it
+   is finished, and prefetches of the same tree wait for each other.
+   At most MAX_JOBS prefetches run at the same time, each limited to
+   its share of the open file limit. */
+#define _GNU_SOURCE 1
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include "fastwalk.h"
+
+enum {
+	MAX_CLIENTS = 64,
+	MAX_JOBS = 4,		/* prefetches running at the same time */
+	OWN_FDS = 8,		/* stdio, the socket and done_pipe */
+	MIN_JOB_FDS = 32,	/* smallest fd limit of the library */
+	REQUEST_MAX = PATH_MAX + 16,	/* a request line */
+	EVENT_BUF = 64 * 1024,
+};
+
+/* Changes that move files or their data. Writes are only seen when
+   the writer closes the file. */
+#define WATCH_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO| \
+		    IN_CLOSE_WRITE|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR)
+
+struct tree {
+	char *path;
+	struct fastwalk *fw;
+	int ifd;		/* inotify, -1 when the index is stale */
+	int busy;		/* prefetches using it, under trees_lock */
+	pthread_mutex_t lock;	/* held by the prefetch using fw */
+};
+
+struct client {
+	int fd;
+	int len;
+	int busy;		/* a prefetch runs for it */
+	char buf[REQUEST_MAX];
+};
+
+/* A prefetch in its own thread */
+struct job {
+	int fd;			/* of the client */
+	char *dir;
+};
+
+/* The trees don't move, the prefetch threads point to them */
+static struct tree **trees;
+static int numtrees;
+static pthread_mutex_t trees_lock = PTHREAD_MUTEX_INITIALIZER;
+static int numjobs;		/* running prefetches, under trees_lock */
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+static int done_pipe[2];	/* gets the client fd of finished jobs */
+
+static struct client clients[MAX_CLIENTS];
+static int numclients;
+
+/* Library options from the command line, passed to each context */
+static int *opts;
+static char **optargs;
+static int numopts;
+
+static int debug;		/* -d, also passed on */
+static int populate;		/* -R, also passed on */
+
+static volatile sig_atomic_t stop;
+
+static void oom(void)
+{
+	fprintf(stderr, "Out of memory\n");
+	exit(ENOMEM);
+}
+
+static void *xrealloc(void *ptr, size_t n)
+{
+	void *p = realloc(ptr, n);
+	if (!p) oom();
+	return p;
+}
+
+static int watch_dir(const char *path, void *arg)
+{
+	struct tree *t = arg;
+	static int once;
+
+	if (t->ifd < 0)
+		return 0;
+	if (inotify_add_watch(t->ifd, path, WATCH_MASK) < 0) {
+		if (errno != ENOSPC)
+			perror(path);
+		else if (!once++)
+			fprintf(stderr, "Out of inotify watches, "
+				"trees are walked again for each request\n");
+		close(t->ifd);
+		t->ifd = -1;
+	}
+	return 0;
+}
+
+/* The fds of one prefetch, what is left after the clients and the
+   inotify instances, split between the prefetches. Under trees_lock */
+static int job_fds(void)
+{
+	struct rlimit rlim;
+	int n;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0)
+		rlim.rlim_cur = 1024;
+	n = rlim.rlim_cur > INT_MAX ? INT_MAX : rlim.rlim_cur;
+	n = (n - OWN_FDS - MAX_CLIENTS - numtrees) / MAX_JOBS;
+	return n < MIN_JOB_FDS ? MIN_JOB_FDS : n;
+}
+
+static void set_fds(struct fastwalk *fw, int fds)
+{
+	char buf[16];
+
+	snprintf(buf, sizeof buf, "%d", fds);
+	if (fastwalk_option(fw, 'n', buf) < 0)
+		perror("option");
+}
+
+/* Walk the tree and sort it again, watching the directories read */
+static int build(struct tree *t, int fds)
+{
+	int i;
+
+	if (debug)
+		fprintf(stderr, "walking %s\n", t->path);
+	if (t->fw)
+		fastwalk_free(t->fw);
+	if (t->ifd >= 0)
+		close(t->ifd);
+	t->ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (t->ifd < 0)
+		perror("inotify");
+	t->fw = fastwalk_new(FASTWALK_REPEAT);
+	for (i = 0; i < numopts; i++)
+		if (fastwalk_option(t->fw, opts[i], optargs[i]) < 0)
+			perror("option");
+	set_fds(t->fw, fds);
+	fastwalk_dir_callback(t->fw, watch_dir, t);
+	fastwalk_add(t->fw, t->path);
+	if (fastwalk_walk(t->fw) < 0)
+		return -1;
+	return fastwalk_sort(t->fw);
+}
+
+/* Any event means the index is stale */
+static void check_events(struct tree *t)
+{
+	char buf[EVENT_BUF];
+	ssize_t n;
+
+	if (t->ifd < 0)
+		return;
+	n = read(t->ifd, buf, sizeof buf);
+	if (n > 0 || (n < 0 && errno != EAGAIN)) {
+		close(t->ifd);
+		t->ifd = -1;
+	}
+}
+
+/* Under trees_lock */
+static struct tree *find_tree(const char *path)
+{
+	struct tree *t;
+	int i;
+
+	for (i = 0; i < numtrees; i++)
+		if (!strcmp(trees[i]->path, path))
+			return trees[i];
+	trees = xrealloc(trees, (numtrees + 1) * sizeof(struct tree *));
+	t = xrealloc(NULL, sizeof(struct tree));
+	trees[numtrees++] = t;
+	t->path = strdup(path);
+	if (!t->path) oom();
+	t->fw = NULL;
+	t->ifd = -1;
+	t->busy = 0;
+	pthread_mutex_init(&t->lock, NULL);
+	return t;
+}
+
+/* Returns 0 or -1, populated gets the bytes of -R unless NULL */
+static int prefetch(const char *dir, unsigned long long *populated)
+{
+	char path[PATH_MAX];
+	struct tree *t;
+	int fds, ret = 0;
+
+	if (!realpath(dir, path)) {
+		perror(dir);
+		return -1;
+	}
+	pthread_mutex_lock(&trees_lock);
+	t = find_tree(path);
+	t->busy++;
+	while (numjobs == MAX_JOBS)
+		pthread_cond_wait(&jobs_cond, &trees_lock);
+	numjobs++;
+	fds = job_fds();
+	pthread_mutex_unlock(&trees_lock);
+
+	pthread_mutex_lock(&t->lock);
+	check_events(t);
+	if (t->ifd < 0)
+		ret = build(t, fds);
+	else
+		set_fds(t->fw, fds);
+	fastwalk_rewind(t->fw);
+	if (fastwalk_iterate(t->fw))
+		ret = -1;
+	if (populated)
+		*populated = fastwalk_populated(t->fw);
+	pthread_mutex_unlock(&t->lock);
+
+	pthread_mutex_lock(&trees_lock);
+	t->busy--;
+	numjobs--;
+	pthread_cond_signal(&jobs_cond);
+	pthread_mutex_unlock(&trees_lock);
+	return ret;
+}
+
+static void reply(int fd, const char *msg)
+{
+	if (send(fd, msg, strlen(msg), MSG_NOSIGNAL) < 0 && errno != EPIPE)
+		perror("send");
+}
+
+static void *run_job(void *arg)
+{
+	struct job *j = arg;
+	unsigned long long populated;
+	char buf[64];
+
+	if (prefetch(j->dir, &populated))
+		reply(j->fd, "error\n");
+	else if (populate) {
+		snprintf(buf, sizeof buf, "ok %llu\n", populated);
+		reply(j->fd, buf);
+	} else
+		reply(j->fd, "ok\n");
+	/* Give the client back to the poll loop */
+	if (write(done_pipe[1], &j->fd, sizeof(int)) < 0)
+		perror("write");
+	free(j->dir);
+	free(j);
+	return NULL;
+}
+
+static void handle_request(struct client *c, char *line)
+{
+	struct job *j;
+	pthread_t thread;
+	int err;
+
+	if (strncmp(line, "prefetch ", 9) || !line[9]) {
+		reply(c->fd, "error unknown request\n");
+		return;
+	}
+	j = xrealloc(NULL, sizeof(struct job));
+	j->fd = c->fd;
+	j->dir = strdup(line + 9);
+	if (!j->dir) oom();
+	c->busy = 1;
+	err = pthread_create(&thread, NULL, run_job, j);
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		run_job(j);
+	} else {
+		pthread_detach(thread);
+	}
+}
+
+static void close_client(int i)
+{
+	close(clients[i].fd);
+	clients[i] = clients[--numclients];
+}
+
+/* Handle the complete lines read, until one starts a prefetch.
+   Returns 0 when the client is finished */
+static int handle_lines(struct client *c)
+{
+	char *nl;
+
+	while (!c->busy && (nl = memchr(c->buf, '\n', c->len)) != NULL) {
+		*nl = 0;
+		handle_request(c, c->buf);
+		c->len -= nl + 1 - c->buf;
+		memmove(c->buf, nl + 1, c->len);
+	}
+	if (!c->busy && c->len == REQUEST_MAX) {
+		reply(c->fd, "error request too long\n");
+		return 0;
+	}
+	return 1;
+}
+
+static int read_client(struct client *c)
+{
+	ssize_t n;
+
+	n = read(c->fd, c->buf + c->len, REQUEST_MAX - c->len);
+	if (n <= 0)
+		return 0;
+	c->len += n;
+	return handle_lines(c);
+}
+
+/* The clients whose prefetch finished go on with their requests */
+static void jobs_done(void)
+{
+	int fds[MAX_CLIENTS];
+	ssize_t n;
+	int i, k;
+
+	n = read(done_pipe[0], fds, sizeof fds);
+	for (k = 0; k < n / (ssize_t)sizeof(int); k++) {
+		for (i = 0; i < numclients; i++)
+			if (clients[i].fd == fds[k] && clients[i].busy)
+				break;
+		if (i == numclients)
+			continue;
+		clients[i].busy = 0;
+		if (!handle_lines(&clients[i]))
+			close_client(i);
+	}
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static int serve(const char *sock, struct sockaddr_un *addr)
+{
+	struct pollfd *pfd = NULL;
+	struct sigaction sa;
+	int lfd, i, n, nt;
+
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (pipe2(done_pipe, O_CLOEXEC|O_NONBLOCK) < 0) {
+		perror("pipe");
+		return 1;
+	}
+	lfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (lfd < 0) {
+		perror("socket");
+		return 1;
+	}
+	unlink(sock);
+	/* Requests name arbitrary trees, so only the user may send them */
+	umask(077);
+	if (bind(lfd, (struct sockaddr *)addr, sizeof(struct sockaddr_un)) < 0 ||
+	    listen(lfd, 16) < 0) {
+		perror(sock);
+		return 1;
+	}
+
+	while (!stop) {
+		pthread_mutex_lock(&trees_lock);
+		nt = numtrees;
+		pfd = xrealloc(pfd, (2 + numclients + nt) *
+				    sizeof(struct pollfd));
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = done_pipe[0];
+		pfd[1].events = POLLIN;
+		/* Clients with a prefetch running wait for it */
+		for (i = 0; i < numclients; i++) {
+			pfd[2 + i].fd = clients[i].busy ? -1 : clients[i].fd;
+			pfd[2 + i].events = POLLIN;
+		}
+		/* Stop the watching of changed trees early, the ones in
+		   use are checked by their prefetch */
+		for (i = 0; i < nt; i++) {
+			pfd[2 + numclients + i].fd = trees[i]->busy ? -1 : trees[i]->ifd;
+			pfd[2 + numclients + i].events = POLLIN;
+		}
+		pthread_mutex_unlock(&trees_lock);
+		n = numclients;
+		if (poll(pfd, 2 + n + nt, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		pthread_mutex_lock(&trees_lock);
+		for (i = 0; i < nt; i++)
+			if (pfd[2 + n + i].revents && !trees[i]->busy)
+				check_events(trees[i]);
+		pthread_mutex_unlock(&trees_lock);
+		for (i = n - 1; i >= 0; i--)
+			if (pfd[2 + i].revents && !read_client(&clients[i]))
+				close_client(i);
+		if (pfd[0].revents) {
+			int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+
+			if (fd < 0) {
+				perror("accept");
+			} else if (numclients == MAX_CLIENTS) {
+				reply(fd, "error too many clients\n");
+				close(fd);
+			} else {
+				clients[numclients].fd = fd;
+				clients[numclients].len = 0;
+				clients[numclients].busy = 0;
+				numclients++;
+			}
+		}
+		if (pfd[1].revents)
+			jobs_done();
+	}
+	unlink(sock);
+	free(pfd);
+	return 0;
+}
+
+/* Ask the daemon to prefetch the trees, one request at a time */
+static int request(struct sockaddr_un *addr, char **dirs, int numdirs)
+{
+	char path[PATH_MAX], buf[256];
+	int fd, i, ret = 0;
+	FILE *f;
+
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0 ||
+	    connect(fd, (struct sockaddr *)addr, sizeof(struct sockaddr_un)) < 0) {
+		perror(addr->sun_path);
+		return 1;
+	}
+	f = fdopen(fd, "r+");
+	if (!f) {
+		perror("fdopen");
+		return 1;
+	}
+	for (i = 0; i < numdirs; i++) {
+		if (!realpath(dirs[i], path)) {
+			perror(dirs[i]);
+			ret = 1;
+			continue;
+		}
+		fprintf(f, "prefetch %s\n", path);
+		fflush(f);
+		if (!fgets(buf, sizeof buf, f)) {
+			fprintf(stderr, "%s: no reply\n", addr->sun_path);
+			ret = 1;
+			break;
+		}
+		if (strcmp(buf, "ok\n") && strncmp(buf, "ok ", 3)) {
+			fprintf(stderr, "%s: %s", dirs[i], buf);
+			ret = 1;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fastwalkd [-SSOCKET] [-pSKIP] [-eGLOB] [-IGLOB] [-zMIN:MAX] [-PCLASS:GLOB] [-HLIST [-GN]] [-R] [-gGAP] [-mMAX] [-D] [-u] [-j[PATH=]N] [tree...]\n"
+			"       fastwalkd -c [-SSOCKET] tree...\n"
+			"Keep the disk order of trees in memory and read them ahead on request.\n"
+			"The trees given are indexed and read ahead at the start.\n"
+			"\n"
+			"-SSOCKET  listen on the Unix socket SOCKET, default\n"
+			"          $XDG_RUNTIME_DIR/fastwalkd.sock\n"
+			"-c     ask the running daemon to read ahead the trees\n"
+			"-R     read the data and answer once it is in the page cache\n"
+			"-pSKIP, -eGLOB, -IGLOB, -zMIN:MAX, -PCLASS:GLOB, -HLIST, -GN,\n"
+			"-gGAP, -mMAX, -D, -u, -jN  as in fastwalk(1)\n");
+	exit(1);
+}
+
+/* Once before they are used for each tree */
+static void check_options(void)
+{
+	struct fastwalk *fw = fastwalk_new(FASTWALK_REPEAT);
+	int i;
+
+	for (i = 0; i < numopts; i++) {
+		if (fastwalk_option(fw, opts[i], optargs[i]) < 0) {
+			if (errno == EINVAL)
+				usage();
+			exit(1);
+		}
+	}
+	fastwalk_free(fw);
+}
+
+int main(int ac, char **av)
+{
+	struct sockaddr_un addr;
+	char *sock = NULL;
+	int opt, i, client = 0;
+	char *dir;
+
+	opts = xrealloc(NULL, (ac + 1) * sizeof(int));
+	optargs = xrealloc(NULL, (ac + 1) * sizeof(char *));
+	opts[numopts++] = 'r';
+	optargs[0] = NULL;
+	while ((opt = getopt(ac, av, "cDde:G:g:H:I:j:m:P:p:RS:uz:")) != -1) {
+		switch (opt) {
+		case 'c':
+			client = 1;
+			break;
+		case 'S':
+			sock = optarg;
+			break;
+		case '?':
+			usage();
+		case 'R':
+			populate = 1;
+			opts[numopts] = opt;
+			optargs[numopts++] = NULL;
+			break;
+		case 'd':
+			debug++;
+			/* FALL THROUGH */
+		default:
+			opts[numopts] = opt;
+			optargs[numopts++] = optarg ? strdup(optarg) : NULL;
+			break;
+		}
+	}
+	if (client && optind == ac)
+		usage();
+
+	memset(&addr, 0, sizeof(struct sockaddr_un));
+	addr.sun_family = AF_UNIX;
+	dir = getenv("XDG_RUNTIME_DIR");
+	if (sock)
+		i = snprintf(addr.sun_path, sizeof addr.sun_path, "%s", sock);
+	else if (dir)
+		i = snprintf(addr.sun_path, sizeof addr.sun_path,
+			     "%s/fastwalkd.sock", dir);
+	else
+		i = snprintf(addr.sun_path, sizeof addr.sun_path,
+			     "/tmp/fastwalkd-%u.sock", (unsigned)getuid());
+	if (i >= sizeof addr.sun_path) {
+		fprintf(stderr, "Socket name too long\n");
+		exit(1);
+	}
+	if (client)
+		return request(&addr, av + optind, ac - optind);
+
+	check_options();
+	for (i = optind; i < ac; i++)
+		prefetch(av[i], NULL);
+	return serve(addr.sun_path, &addr);
+}
@@ -0,0 +1,3725 @@
+/* Copyright (c) 2010-2013 by Intel Corp.
+
+   fastwalk is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; version
+   2.
+
+   fastwalk is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should find a copy of v2 of the GNU General Public License somewhere
+   on your Linux system.
+
+   Author:
+   Andi Kleen */
+
+/* The walk, the disk order sort and the readahead of fastwalk as a
+   library, see fastwalk.h. All state is in struct fastwalk, so that
+   several walks can run in one process. */
+#define _GNU_SOURCE 1
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <unistd.h>
+#include <errno.h>
+#include <alloca.h>
+#include <string.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#include <limits.h>
+#include <pthread.h>
+#include "list.h"
+#include "uring.h"
+#include "sort.h"
+#include "cache.h"
+#include "progress.h"
+#include "action.h"
+#include "stats.h"
+#include "topology.h"
+#include "match.h"
+#include "fastwalk.h"
+
+typedef unsigned long long u64;
+typedef long long s64;
+
+struct fd;
+
+/* Kept small, there is one per file */
+struct entry { 
+	u64 ino;
+	union {
+		struct fd *fd;
+		u64 disk;
+		int rawfd;	/* kept open by the metadata pass */
+	};
+	unsigned name;		/* leaf name offset in names */
+	int dir;		/* index into dnames */
+	unsigned dev : 20;	/* index into devs */
+	unsigned trusted : 1;	/* in an unchanged directory (-i) */
+	unsigned excluded : 1;	/* by -I or -z, not read or output */
+	unsigned prio : 4;	/* class of -P, lower is read first */
+	unsigned kept : 1;	/* rawfd is valid */
+	unsigned resident : 1;	/* already in the page cache */
+	unsigned type : 4;	/* DT_* */
+	unsigned numextents;
+};
+
+enum { 
+	START_SIZE = (64 * 4096)/sizeof(struct entry),
+	EXTENTS_START = 4096,
+	DIRS_START = 1024,
+	NAMES_START = 1024 * 1024,
+	DENTBUF_SIZE = 1024 * 1024,
+	URING_BATCH = 64,
+	FIEMAP_START = 32,	/* extents per FIEMAP call, doubled */
+	FIEMAP_MAX = 4096,
+	MERGE_GAP = 128 * 1024,
+	MINCORE_VEC = 4096,	/* pages per mincore call */
+	DIRFDS = 64,		/* directory fds per thread */
+	DIRFD_HASH = 256,
+	EXTENT_MAX = 1U << 31,	/* longer extents are split */
+	MAX_DEVS = 1 << 20,
+	PRIO_DEFAULT = 8,	/* of files no -P matches */
+	PRIO_RANGE = 7,		/* -P takes -7 to 7 */
+	HINT_GROUP = 1024,	/* default files per hint batch */
+	HINT_NONE = ~0U,	/* batch of the files not in the hints */
+	BULKSTAT_BATCH = 256,	/* inodes per XFS bulkstat call */
+	SSD_DEPTH = 8,		/* default requests in flight on SSDs */
+	MAX_PARTS = 64,		/* readahead workers per device */
+	WORKER_FDS = 8,		/* at least per readahead worker */
+	MIN_FDS = 32,		/* smallest -n */
+	ACTION_BUF = 1024 * 1024, /* read size for -x */
+	POPULATE_BUF = 1024 * 1024, /* read size for -R */
+};
+
+struct extent {
+	u64 disk;
+	u64 offset;
+	unsigned len;
+	unsigned entry;		/* index into entries */
+};
+
+struct fd { 
+	struct entry *entry;
+	struct list_head lru;
+	int fd;
+};
+
+/* Per entry details for the info of the callbacks, indexed like entries */
+struct info {
+	u64 size;
+	u64 disk;		/* of the first extent, 0 when unknown */
+	unsigned numextents;	/* in the file, not only the ones kept */
+};
+
+struct stamp {
+	u64 mtime;
+	u64 size;
+	int valid;
+};
+
+/* Per directory, only with a cache file */
+struct dstamp {
+	u64 ino;
+	u64 mtime;
+	u64 ctime;
+	unsigned dev;
+	int valid;		/* completely listed in this run */
+};
+
+struct dname {
+	int parent;		/* -1 for the directories on the command line */
+	unsigned name;
+};
+
+struct dirfd {
+	struct list_head lru;
+	struct dirfd *next;	/* hash chain */
+	int dir;		/* index into dnames */
+	int fd;
+	int pinned;		/* in flight in io_uring, don't close */
+};
+
+struct dircache {
+	struct list_head lru;
+	struct dirfd *hash[DIRFD_HASH];
+	int num, max;
+};
+
+/* Everything of one walk. The worker threads of the passes share it. */
+struct fastwalk {
+	int flags;		/* FASTWALK_* */
+	int error;
+
+	/* Options */
+	int debug;
+	int do_readahead;
+	int populate;		/* read the data instead (-R) */
+	int use_uring;
+	int incremental;
+	int batch;		/* files per batch in streaming mode */
+	int dir_order;		/* read directories in block order (-D) */
+	u64 merge_gap;		/* max disk gap inside a read run */
+	u64 max_bytes;		/* readahead budget (-m), 0 for none */
+	u64 window;		/* max bytes ahead of the consumer (-w) */
+	char *progress_list;	/* consumer file list (-f), else fanotify */
+	struct action *action;	/* run on the file contents (-x) */
+	char *action_arg;
+	void *action_parsed;	/* what action->parse made of it */
+	char *cachefile;
+	char **skip;		/* -p and -e, for the cache */
+	int numskip;
+	struct match exclude;	/* names not walked (-p, -e) */
+	struct match include;	/* only files matching these (-I) */
+	int numincludes;
+	struct match prios;	/* PRIO_DEFAULT + -P class */
+	int filter;		/* -I, -P or -H given */
+	u64 min_size, max_size;	/* -z */
+	char *hint_list;	/* files in the order they are needed (-H) */
+	int hint_group;		/* files per hint batch (-G) */
+	struct hint_slot *hint_hash;
+	unsigned hint_size;
+	unsigned *hints;	/* hint batch of each entry, with -H */
+	struct devdepth *depths;
+	int numdepths;
+	int default_depth;	/* -jN, else from the topology */
+
+	fastwalk_file_fn file_fn;
+	fastwalk_extent_fn extent_fn;
+	void *arg;		/* of the callbacks */
+	fastwalk_dir_fn dir_fn;
+	void *dir_arg;
+
+	struct entry *entries;
+	int maxentries, numentries;
+	int flushed;		/* entries before this are done */
+	int sorted;		/* the others are sorted by disk */
+	int sorted_ext;		/* their first extent */
+	int stopped;		/* by a callback */
+	struct info *infos;	/* only with FASTWALK_INFO */
+
+	struct extent *extents;
+	int maxextents, numextents;
+	pthread_mutex_t extents_lock;
+
+	dev_t *devs;
+	int numdevs;
+	unsigned last_dev;	/* of the previous dev_index() */
+	struct devtopo *topos;
+	int numtopos;
+
+	char *names;		/* see add_name() */
+	size_t numnames, maxnames;
+	struct dname *dnames;
+	int numdnames, maxdnames;
+
+	struct dir *dirs;	/* queued for the walk */
+	int maxdirs, numdirs;
+	struct dircache walk_dirs;
+	char *dentbuf;
+
+	struct cache cache;
+	int cache_files_ok;
+	struct stamp *stamps;	/* per entry, only with a cache file */
+	struct dstamp *dstamps;
+	u64 skiphash;
+
+	int max_fds;		/* of -n, otherwise RLIMIT_NOFILE */
+	int kept_fds, max_kept;
+	u64 read_bytes;		/* readahead issued so far */
+	u64 populated;		/* resident after the reads of -R */
+
+	/* Consumer tracking of -w */
+	pthread_mutex_t window_lock;
+	pthread_cond_t window_cond;
+	u64 outstanding;	/* read ahead and not consumed yet */
+	u64 *issued;		/* per entry */
+	char *consumed;
+	int maxconsumed;
+	struct window_slot *window_hash;
+	unsigned window_size;	/* power of two */
+	int consumer_done;
+	struct progress *progress;
+};
+
+#define Perror(fw, x) (perror(x), (fw)->error = 1)
+
+static u64 ts_ns(u64 sec, u64 nsec)
+{
+	return sec * 1000000000ULL + nsec;
+}
+
+static void oom(void)
+{
+	fprintf(stderr, "Out of memory\n");
+	exit(ENOMEM);
+}
+
+static void *xrealloc(void *ptr, size_t n)
+{
+	void *p = realloc(ptr, n);
+	if (!p) oom();
+	return p;
+}
+
+static void *xmalloc(size_t n)
+{
+	void *p = malloc(n);
+	if (!p) oom();
+	return p;
+}
+
+static char *xstrdup(const char *s)
+{
+	char *p = strdup(s);
+	if (!p) oom();
+	return p;
+}
+
+/* Names are stored as leaf names in a single arena, together with
+   the index of the parent directory. Full paths are only built 
+   when a file is opened or output. */
+
+static unsigned add_name(struct fastwalk *fw, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	unsigned off;
+
+	if (fw->numnames + len > UINT_MAX) {
+		fprintf(stderr, "Too many file names\n");
+		exit(1);
+	}
+	if (fw->numnames + len > fw->maxnames) {
+		if (fw->maxnames == 0)
+			fw->maxnames = NAMES_START;
+		while (fw->numnames + len > fw->maxnames)
+			fw->maxnames *= 2;
+		fw->names = xrealloc(fw->names, fw->maxnames);
+	}
+	off = fw->numnames;
+	memcpy(fw->names + off, s, len);
+	fw->numnames += len;
+	return off;
+}
+
+static int add_dname(struct fastwalk *fw, int parent, unsigned name, u64 ino)
+{
+	struct dname *d;
+	if (fw->numdnames >= fw->maxdnames) {
+		if (fw->maxdnames == 0)
+			fw->maxdnames = DIRS_START;
+		else
+			fw->maxdnames *= 2;
+		fw->dnames = xrealloc(fw->dnames, fw->maxdnames * sizeof(struct dname));
+		if (fw->cachefile)
+			fw->dstamps = xrealloc(fw->dstamps, 
+					   fw->maxdnames * sizeof(struct dstamp));
+	}
+	if (fw->dstamps) {
+		memset(&fw->dstamps[fw->numdnames], 0, sizeof(struct dstamp));
+		fw->dstamps[fw->numdnames].ino = ino;
+	}
+	d = &fw->dnames[fw->numdnames];
+	d->parent = parent;
+	d->name = name;
+	return fw->numdnames++;
+}
+
+/* Build the path of leaf in directory dir backwards from the end of
+   buf, which must be PATH_MAX sized. Returns the start of the path
+   or NULL with errno set when it does not fit. */
+static char *build_path(struct fastwalk *fw, int dir, const char *leaf, char *buf)
+{
+	char *p = buf + PATH_MAX;
+	const char *s = leaf;
+	size_t len;
+
+	*--p = 0;
+	for (;;) {
+		len = strlen(s);
+		if (p - buf < len + 1) {
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
+		p -= len;
+		memcpy(p, s, len);
+		if (dir < 0)
+			return p;
+		*--p = '/';
+		s = fw->names + fw->dnames[dir].name;
+		dir = fw->dnames[dir].parent;
+	}
+}
+
+static char *dir_path(struct fastwalk *fw, int dir, char *buf)
+{
+	return build_path(fw, fw->dnames[dir].parent, fw->names + fw->dnames[dir].name, buf);
+}
+
+static char *entry_path(struct fastwalk *fw, struct entry *e, char *buf)
+{
+	return build_path(fw, e->dir, fw->names + e->name, buf);
+}
+
+static void entry_error(struct fastwalk *fw, struct entry *e)
+{
+	char buf[PATH_MAX];
+	int err = errno;
+	char *path = entry_path(fw, e, buf);
+
+	errno = err;
+	Perror(fw, path ? path : fw->names + e->name);
+}
+
+/* Directory fds, so that files are opened and stat'ed with their leaf
+   name relative to the directory instead of letting the kernel walk
+   the full path every time. Each thread has its own small LRU of 
+   O_PATH fds, a missing directory is opened relative to its parent. */
+
+static int fd_budget(struct fastwalk *fw)
+{
+	struct rlimit rlim;
+	int n;
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0)
+		rlim.rlim_cur = 100;
+	n = rlim.rlim_cur;
+	if (fw->max_fds && fw->max_fds < n)
+		n = fw->max_fds;
+	n -= n / 10; /* save 10% for safety */
+	n -= fw->walk_dirs.num; /* still open with -b */
+	return n;
+}
+
+/* A quarter of a fd share is used for directories */
+static int dirfd_share(int fds)
+{
+	return fds / 4 < DIRFDS ? fds / 4 : DIRFDS;
+}
+
+static void init_dirfds(struct dircache *c, int max)
+{
+	memset(c, 0, sizeof(struct dircache));
+	INIT_LIST_HEAD(&c->lru);
+	c->max = max > 1 ? max : 1;
+}
+
+static void close_dirfd(struct dircache *c, struct dirfd *d)
+{
+	struct dirfd **p = &c->hash[d->dir % DIRFD_HASH];
+
+	while (*p != d)
+		p = &(*p)->next;
+	*p = d->next;
+	list_del(&d->lru);
+	close(d->fd);
+	stat_inc(ST_CLOSE);
+	free(d);
+	c->num--;
+}
+
+/* Close the least recently used fd that is not pinned */
+static int evict_dirfd(struct dircache *c)
+{
+	struct list_head *l;
+
+	for (l = c->lru.prev; l != &c->lru; l = l->prev) {
+		struct dirfd *d = list_entry(l, struct dirfd, lru);
+		if (!d->pinned) {
+			stat_inc(ST_DIRFD_EVICT);
+			close_dirfd(c, d);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void unpin_dirfds(struct dircache *c)
+{
+	struct list_head *l;
+
+	list_for_each (l, &c->lru)
+		list_entry(l, struct dirfd, lru)->pinned = 0;
+}
+
+static void exit_dirfds(struct dircache *c)
+{
+	while (c->num > 0)
+		close_dirfd(c, list_entry(c->lru.next, struct dirfd, lru));
+}
+
+/* Returns a fd for directory dir or -1 with errno set. It stays valid
+   until the next call, or with pin until unpin_dirfds(). */
+static int dir_fd(struct fastwalk *fw, struct dircache *c, int dir, int pin)
+{
+	struct dirfd **hp = &c->hash[dir % DIRFD_HASH];
+	struct dirfd *d;
+	int pfd = AT_FDCWD, fd;
+
+	for (d = *hp; d; d = d->next) {
+		if (d->dir == dir) {
+			list_del(&d->lru);
+			list_add(&d->lru, &c->lru);
+			d->pinned |= pin;
+			stat_inc(ST_DIRFD_HIT);
+			return d->fd;
+		}
+	}
+	stat_inc(ST_DIRFD_MISS);
+
+	if (fw->dnames[dir].parent >= 0) {
+		pfd = dir_fd(fw, c, fw->dnames[dir].parent, 0);
+		if (pfd < 0)
+			return -1;
+	}
+	fd = openat(pfd, fw->names + fw->dnames[dir].name, O_PATH|O_DIRECTORY);
+	stat_inc(ST_OPEN);
+	if (fd < 0)
+		return -1;
+	while (c->num >= c->max && evict_dirfd(c))
+		;
+
+	d = xmalloc(sizeof(struct dirfd));
+	d->dir = dir;
+	d->fd = fd;
+	d->pinned = pin;
+	d->next = *hp;
+	*hp = d;
+	list_add(&d->lru, &c->lru);
+	c->num++;
+	return fd;
+}
+
+/* The fd of the parent of dir, which is the cwd for the roots */
+static int parent_fd(struct fastwalk *fw, struct dircache *c, int dir)
+{
+	if (fw->dnames[dir].parent < 0)
+		return AT_FDCWD;
+	return dir_fd(fw, c, fw->dnames[dir].parent, 0);
+}
+
+static inline struct entry *ext_entry(struct fastwalk *fw, struct extent *ex)
+{
+	return &fw->entries[ex->entry];
+}
+
+static unsigned dev_index(struct fastwalk *fw, dev_t dev)
+{
+	unsigned i;
+
+	if (fw->last_dev < fw->numdevs && fw->devs[fw->last_dev] == dev)
+		return fw->last_dev;
+	for (i = 0; i < fw->numdevs; i++)
+		if (fw->devs[i] == dev)
+			return fw->last_dev = i;
+	if (fw->numdevs >= MAX_DEVS) {
+		fprintf(stderr, "Too many devices\n");
+		exit(1);
+	}
+	fw->devs = xrealloc(fw->devs, (fw->numdevs + 1) * sizeof(dev_t));
+	fw->devs[fw->numdevs] = dev;
+	return fw->last_dev = fw->numdevs++;
+}
+
+static struct entry *getentry(struct fastwalk *fw)
+{
+	struct entry *e;
+	if (fw->numentries >= fw->maxentries) {
+		if (fw->maxentries == 0)
+			fw->maxentries = START_SIZE;
+		else
+			fw->maxentries *= 2;
+		fw->entries = xrealloc(fw->entries, fw->maxentries * sizeof(struct entry));
+	}
+	e = &fw->entries[fw->numentries++];
+	memset(e, 0, sizeof(struct entry));
+	return e;
+}
+
+/* FNV-1a over the skip list, to notice when it changed */
+static u64 hash_skip(char **skip, int skipcnt)
+{
+	u64 h = 14695981039346656037ULL;
+	int k;
+	char *p;
+
+	for (k = 0; k < skipcnt; k++)
+		for (p = skip[k]; ; p++) {
+			h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+			if (!*p)
+				break;
+		}
+	return h;
+}
+
+/* Directory queue for the breadth first walk */
+
+struct dir {
+	ino_t ino;
+	int index;		/* into dnames */
+	u64 disk;		/* of the first directory block, with -D */
+};
+
+static void queue_dir(struct fastwalk *fw, int index, ino_t ino)
+{
+	struct dir *d;
+	if (fw->numdirs >= fw->maxdirs) {
+		if (fw->maxdirs == 0)
+			fw->maxdirs = DIRS_START;
+		else
+			fw->maxdirs *= 2;
+		fw->dirs = xrealloc(fw->dirs, fw->maxdirs * sizeof(struct dir));
+	}
+	d = &fw->dirs[fw->numdirs++];
+	d->ino = ino;
+	d->index = index;
+	d->disk = 0;
+}
+
+static void set_dstamp(struct fastwalk *fw, int index, struct stat *st)
+{
+	struct dstamp *ds;
+	if (!fw->dstamps)
+		return;
+	ds = &fw->dstamps[index];
+	ds->ino = st->st_ino;
+	ds->mtime = ts_ns(st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+	ds->ctime = ts_ns(st->st_ctim.tv_sec, st->st_ctim.tv_nsec);
+	ds->dev = dev_index(fw, st->st_dev);
+	ds->valid = 1;
+}
+
+/* Incremental mode (-i): if the directory did not change since the 
+   cache was written, take its children from the cache instead of
+   reading it. The files in it are likely unchanged too, they are
+   stat'ed before they are opened. */
+static int replay_dir(struct fastwalk *fw, int index, int *found_unknown)
+{
+	struct cache_dir *cd;
+	struct stat st;
+	unsigned i;
+	int pfd;
+
+	if (!fw->cache.hdr || fw->cache.hdr->skiphash != fw->skiphash)
+		return 0;
+	pfd = parent_fd(fw, &fw->walk_dirs, index);
+	stat_inc(ST_STAT);
+	if (pfd == -1 || 
+	    fstatat(pfd, fw->names + fw->dnames[index].name, &st, 0) < 0)
+		return 0;
+	cd = cache_lookup_dir(&fw->cache, st.st_dev, st.st_ino);
+	if (!cd || 
+	    cd->mtime != ts_ns(st.st_mtim.tv_sec, st.st_mtim.tv_nsec) ||
+	    cd->ctime != ts_ns(st.st_ctim.tv_sec, st.st_ctim.tv_nsec))
+		return 0;
+
+	for (i = 0; i < cd->numchildren; i++) {
+		struct cache_child *c = &fw->cache.children[cd->child + i];
+		unsigned name = add_name(fw, fw->cache.names + c->name);
+
+		if (c->type == DT_DIR) {
+			queue_dir(fw, add_dname(fw, index, name, c->ino), c->ino);
+		} else {
+			struct entry *e = getentry(fw);
+
+			e->type = c->type;
+			e->ino = c->ino;
+			e->dev = dev_index(fw, st.st_dev);
+			e->dir = index;
+			e->name = name;
+			e->trusted = 1;
+			if (e->type == DT_UNKNOWN)
+				*found_unknown = 1;
+		}
+	}
+	set_dstamp(fw, index, &st);
+	return 1;
+}
+
+/* Raw getdents64 into one big buffer, which is reused for all 
+   directories. This gets large directories in few system calls. */
+
+struct linux_dirent64 {
+	u64 d_ino;
+	s64 d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static long sys_getdents64(int fd, char *buf, unsigned len)
+{
+	stat_inc(ST_GETDENTS);
+	return syscall(SYS_getdents64, fd, buf, len);
+}
+
+/* Read a single directory. Files go into entries, sub directories
+   are queued for the next level. */
+static int read_dir(struct fastwalk *fw, int index)
+{
+	int found_unknown = 0;
+	struct stat st;
+	char buf[PATH_MAX];
+	char *dir = dir_path(fw, index, buf);
+	struct linux_dirent64 *de;
+	unsigned dev;
+	long n, off;
+	int fd;
+
+	/* Before reading it, so that the caller can see later changes */
+	if (dir && fw->dir_fn) {
+		int ret = fw->dir_fn(dir, fw->dir_arg);
+		if (ret) {
+			fw->stopped = ret;
+			return 0;
+		}
+	}
+	if (dir && fw->incremental && replay_dir(fw, index, &found_unknown))
+		return found_unknown;
+
+	fd = -1;
+	if (dir && (fd = parent_fd(fw, &fw->walk_dirs, index)) != -1) {
+		fd = openat(fd, fw->names + fw->dnames[index].name, 
+			    O_RDONLY|O_DIRECTORY);
+		stat_inc(ST_OPEN);
+	}
+	if (fd < 0) { 
+		Perror(fw, dir ? dir : fw->names + fw->dnames[index].name);
+		return 0;
+	}
+	stat_inc(ST_STAT);
+	if (fstat(fd, &st) < 0) { 
+		Perror(fw, dir);
+		close(fd);
+		stat_inc(ST_CLOSE);
+		return found_unknown;
+	}
+
+	if (!fw->dentbuf)
+		fw->dentbuf = xmalloc(DENTBUF_SIZE);
+	dev = dev_index(fw, st.st_dev);
+	while ((n = sys_getdents64(fd, fw->dentbuf, DENTBUF_SIZE)) > 0) {
+		for (off = 0; off < n; off += de->d_reclen) {
+			unsigned name;
+
+			de = (struct linux_dirent64 *)(fw->dentbuf + off);
+			if (match_name(&fw->exclude, de->d_name) >= 0)
+				continue;
+
+			name = add_name(fw, de->d_name);
+			if (de->d_type == DT_DIR) { 
+				queue_dir(fw, add_dname(fw, index, name, de->d_ino), 
+					  de->d_ino);
+			} else {
+				struct entry *e = getentry(fw); 
+
+				e->type = de->d_type;
+				e->ino = de->d_ino;
+				e->dev = dev;
+				e->dir = index;
+				e->name = name;
+
+				if (e->type == DT_UNKNOWN) {
+					found_unknown = 1;
+					if (fw->debug)
+						fprintf(stderr, "%s/%s: DT_UNKNOWN\n", 
+							dir, de->d_name);
+				}
+			}
+		}
+	} 
+		
+	if (n < 0)
+		Perror(fw, dir);
+	else
+		set_dstamp(fw, index, &st);
+	close(fd);
+	stat_inc(ST_CLOSE);
+	return found_unknown;
+}
+
+static void sort_dirs(struct dir *d, int n, int by_disk)
+{
+	struct sortkey *keys = xmalloc(n * sizeof(struct sortkey));
+	int i;
+
+	for (i = 0; i < n; i++) {
+		keys[i].key = by_disk ? d[i].disk : d[i].ino;
+		keys[i].index = i;
+	}
+	radix_sort(keys, n);
+	radix_permute(d, n, sizeof(struct dir), keys);
+	free(keys);
+}
+
+/* The location of the first block of a directory. ext4 and XFS map
+   directories with FIEMAP like files. 0 when it is not known. */
+static u64 dir_disk(struct fastwalk *fw, int index)
+{
+	struct {
+		struct fiemap fm;
+		struct fiemap_extent fe;
+	} req;
+	int pfd = parent_fd(fw, &fw->walk_dirs, index), fd;
+	u64 disk = 0;
+
+	if (pfd == -1)
+		return 0;
+	fd = openat(pfd, fw->names + fw->dnames[index].name, O_RDONLY|O_DIRECTORY);
+	stat_inc(ST_OPEN);
+	if (fd < 0)
+		return 0;
+	memset(&req, 0, sizeof(req));
+	req.fm.fm_length = FIEMAP_MAX_OFFSET;
+	req.fm.fm_extent_count = 1;
+	stat_inc(ST_FIEMAP);
+	if (ioctl(fd, FS_IOC_FIEMAP, &req) == 0 && 
+	    req.fm.fm_mapped_extents == 1 &&
+	    !(req.fe.fe_flags & (FIEMAP_EXTENT_UNKNOWN|
+				 FIEMAP_EXTENT_DATA_INLINE)))
+		disk = req.fe.fe_physical;
+	close(fd);
+	stat_inc(ST_CLOSE);
+	return disk;
+}
+
+static void flush_batch(struct fastwalk *fw);
+
+/* Walk the queued directories breadth first. Each level is sorted
+   by inode number before reading, so that the directory inodes 
+   are read in (approximately) disk order instead of readdir order. */
+static int walk(struct fastwalk *fw)
+{
+	int i, n, found_unknown = 0;
+	struct dir *level;
+
+	/* A callback may stop the streaming mode */
+	while (fw->numdirs > 0 && !fw->stopped) {
+		level = fw->dirs;
+		n = fw->numdirs;
+		fw->dirs = NULL;
+		fw->numdirs = fw->maxdirs = 0;
+
+		/* The inodes are read in inode order, which is the order 
+		   of the inode tables. With -D the directory blocks are 
+		   then read in their own disk order. */
+		sort_dirs(level, n, 0);
+		if (fw->dir_order) {
+			for (i = 0; i < n; i++)
+				level[i].disk = dir_disk(fw, level[i].index);
+			sort_dirs(level, n, 1);
+		}
+		for (i = 0; i < n && !fw->stopped; i++) {
+			if (read_dir(fw, level[i].index))
+				found_unknown = 1;
+			flush_batch(fw);
+		}
+		free(level);
+	}
+	return found_unknown;
+}
+
+/* Sort the entries from start on by device and inode */
+static void sort_inodes(struct fastwalk *fw, int start)
+{
+	int i, n = fw->numentries - start;
+	struct entry *ents = fw->entries + start;
+	struct sortkey *keys = xmalloc(n * sizeof(struct sortkey));
+
+	for (i = 0; i < n; i++) {
+		keys[i].key = ents[i].ino;
+		keys[i].index = i;
+	}
+	radix_sort(keys, n);
+	for (i = 0; i < n; i++)
+		keys[i].key = ents[keys[i].index].dev;
+	radix_sort(keys, n);
+	radix_permute(ents, n, sizeof(struct entry), keys);
+	free(keys);
+}
+
+/* Sort the entries from start on by device, and by disk order within
+   each device, using the extents from ext on. Only for the first extent.
+   The keys are not stored in the entries, which may hold a kept fd. */
+static void sort_entries_disk(struct fastwalk *fw, int start, int ext)
+{
+	int i, n = fw->numentries - start;
+	struct entry *ents = fw->entries + start;
+	struct sortkey *keys = xmalloc(n * sizeof(struct sortkey));
+
+	for (i = 0; i < n; i++) {
+		keys[i].key = 0;
+		keys[i].index = i;
+	}
+	for (i = fw->numextents - 1; i >= ext; i--)
+		keys[fw->extents[i].entry - start].key = fw->extents[i].disk;
+	if (fw->infos)
+		for (i = 0; i < n; i++)
+			fw->infos[start + i].disk = keys[i].key;
+	radix_sort(keys, n);
+	if (stats_on) {
+		/* The distances between the files in output order */
+		u64 *last = xmalloc(fw->numdevs * sizeof(u64));
+
+		memset(last, 0, fw->numdevs * sizeof(u64));
+		for (i = 0; i < n; i++)
+			if (keys[i].key)
+				stats_seek(&last[ents[keys[i].index].dev], 
+					   keys[i].key, 0);
+		free(last);
+	}
+	if (fw->hints) {
+		for (i = 0; i < n; i++)
+			keys[i].key = fw->hints[start + keys[i].index];
+		radix_sort(keys, n);
+	}
+	if (fw->filter) {
+		for (i = 0; i < n; i++)
+			keys[i].key = ents[keys[i].index].prio;
+		radix_sort(keys, n);
+	}
+	for (i = 0; i < n; i++)
+		keys[i].key = ents[keys[i].index].dev;
+	radix_sort(keys, n);
+	radix_permute(ents, n, sizeof(struct entry), keys);
+	if (fw->infos)
+		radix_permute(fw->infos + start, n, sizeof(struct info), keys);
+	if (fw->hints)
+		radix_permute(fw->hints + start, n, sizeof(unsigned), keys);
+	free(keys);
+}
+
+/* Sort the extents from start on by device, and by disk order within 
+   each device, -P class and hint batch */
+static void sort_extents(struct fastwalk *fw, int start)
+{
+	int i, n = fw->numextents - start;
+	struct extent *exts = fw->extents + start;
+	struct sortkey *keys = xmalloc(n * sizeof(struct sortkey));
+
+	for (i = 0; i < n; i++) {
+		keys[i].key = exts[i].disk;
+		keys[i].index = i;
+	}
+	radix_sort(keys, n);
+	if (fw->hints) {
+		for (i = 0; i < n; i++)
+			keys[i].key = fw->hints[exts[keys[i].index].entry];
+		radix_sort(keys, n);
+	}
+	if (fw->filter) {
+		for (i = 0; i < n; i++)
+			keys[i].key = ext_entry(fw, &exts[keys[i].index])->prio;
+		radix_sort(keys, n);
+	}
+	for (i = 0; i < n; i++)
+		keys[i].key = ext_entry(fw, &exts[keys[i].index])->dev;
+	radix_sort(keys, n);
+	radix_permute(exts, n, sizeof(struct extent), keys);
+	free(keys);
+}
+
+/* Drop the extents of files found in the page cache from start on */
+static void drop_resident(struct fastwalk *fw, int start)
+{
+	int i, k;
+
+	for (k = start, i = start; i < fw->numextents; i++) {
+		struct entry *e = ext_entry(fw, &fw->extents[i]);
+		if (e->resident)
+			e->numextents = 0;
+		else
+			fw->extents[k++] = fw->extents[i];
+	}
+	fw->numextents = k;
+}
+
+/* The sorted extents from start on are split into runs, where each
+   extent starts less than merge_gap after the end of the previous one
+   on the same device, -P class and hint batch. A run is submitted
+   together, so that the block layer can merge the reads of neighbouring
+   small files into long requests. Extents of the same file that
+   continue each other inside a run become a single read. */
+static int run_break(struct fastwalk *fw, struct extent *a, struct extent *b)
+{
+	return ext_entry(fw, a)->dev != ext_entry(fw, b)->dev ||
+		ext_entry(fw, a)->prio != ext_entry(fw, b)->prio ||
+		(fw->hints && fw->hints[a->entry] != fw->hints[b->entry]) ||
+		b->disk > a->disk + a->len + fw->merge_gap;
+}
+
+static void coalesce_extents(struct fastwalk *fw, int start)
+{
+	int i, k;
+
+	if (fw->numextents - start < 2)
+		return;
+	for (k = start, i = start + 1; i < fw->numextents; i++) {
+		struct extent *a = &fw->extents[k], *b = &fw->extents[i];
+
+		if (a->entry == b->entry && !run_break(fw, a, b) &&
+		    a->offset + a->len == b->offset &&
+		    (u64)a->len + b->len <= EXTENT_MAX) {
+			a->len += b->len;
+			ext_entry(fw, a)->numextents--;
+			stat_inc(ST_EXTENTS_COALESCED);
+		} else {
+			fw->extents[++k] = *b;
+		}
+	}
+	fw->numextents = k + 1;
+}
+
+/* Old XFS without ftype does not return the file type in readdir.
+   Bulkstat returns the inodes of the file system in inode number 
+   order, many per call, which is much cheaper than a stat of each 
+   file by name. Needs CAP_SYS_ADMIN. The structures are from 
+   xfs_fs.h, which is not always installed. */
+
+#define XFS_SUPER_MAGIC 0x58465342
+
+struct xfs_bstime {
+	long tv_sec;
+	int tv_nsec;
+};
+
+struct xfs_bstat {
+	u64 bs_ino;
+	unsigned short bs_mode;
+	unsigned short bs_nlink;
+	unsigned bs_uid;
+	unsigned bs_gid;
+	unsigned bs_rdev;
+	int bs_blksize;
+	s64 bs_size;
+	struct xfs_bstime bs_atime;
+	struct xfs_bstime bs_mtime;
+	struct xfs_bstime bs_ctime;
+	s64 bs_blocks;
+	unsigned bs_xflags;
+	int bs_extsize;
+	int bs_extents;
+	unsigned bs_gen;
+	unsigned short bs_projid_lo;
+	unsigned short bs_forkoff;
+	unsigned short bs_projid_hi;
+	unsigned short bs_sick;
+	unsigned short bs_checked;
+	unsigned char bs_pad[2];
+	unsigned bs_cowextsize;
+	unsigned bs_dmevmask;
+	unsigned short bs_dmstate;
+	unsigned short bs_aextents;
+};
+
+struct xfs_fsop_bulkreq {
+	u64 *lastip;
+	int icount;
+	void *ubuffer;
+	int *ocount;
+};
+
+#define XFS_IOC_FSBULKSTAT _IOWR('X', 101, struct xfs_fsop_bulkreq)
+
+static int no_bulkstat;
+
+/* A real fd on the file system of the entries of dir, O_PATH fds 
+   don't do ioctls. Returns -1 when it is not XFS. */
+static int xfs_fd(struct fastwalk *fw, int dir)
+{
+	struct statfs sfs;
+	int pfd = parent_fd(fw, &fw->walk_dirs, dir), fd;
+
+	if (pfd == -1)
+		return -1;
+	fd = openat(pfd, fw->names + fw->dnames[dir].name, O_RDONLY|O_DIRECTORY);
+	stat_inc(ST_OPEN);
+	if (fd < 0)
+		return -1;
+	if (fstatfs(fd, &sfs) == 0 && sfs.f_type == XFS_SUPER_MAGIC)
+		return fd;
+	close(fd);
+	stat_inc(ST_CLOSE);
+	return -1;
+}
+
+/* Set the types of the DT_UNKNOWN entries from start to end, which 
+   are on one device and sorted by inode, from bulkstat. Entries it 
+   misses stay unknown. */
+static void bulkstat_types(struct fastwalk *fw, int start, int end)
+{
+	struct xfs_bstat *bs;
+	struct xfs_fsop_bulkreq req;
+	u64 last;
+	int i = start, k, n, fd;
+
+	while (i < end && fw->entries[i].type != DT_UNKNOWN)
+		i++;
+	if (i == end || (fd = xfs_fd(fw, fw->entries[i].dir)) < 0)
+		return;
+	bs = xmalloc(BULKSTAT_BATCH * sizeof(struct xfs_bstat));
+	req.lastip = &last;
+	req.icount = BULKSTAT_BATCH;
+	req.ubuffer = bs;
+	req.ocount = &n;
+	while (i < end) {
+		/* Continue after the last inode returned, or skip ahead to
+		   the next one that is needed */
+		last = fw->entries[i].ino - 1;
+		stat_inc(ST_STAT);
+		if (ioctl(fd, XFS_IOC_FSBULKSTAT, &req) < 0) {
+			if (errno == EPERM || errno == ENOTTY || 
+			    errno == EINVAL)
+				no_bulkstat = 1;
+			break;
+		}
+		if (n == 0)
+			break;
+		for (k = 0; k < n && i < end; ) {
+			if (fw->entries[i].type != DT_UNKNOWN || 
+			    fw->entries[i].ino < bs[k].bs_ino) {
+				i++;
+			} else if (fw->entries[i].ino > bs[k].bs_ino) {
+				k++;
+			} else {
+				fw->entries[i++].type = IFTODT(bs[k].bs_mode);
+			}
+		}
+	}
+	free(bs);
+	close(fd);
+	stat_inc(ST_CLOSE);
+}
+
+static int no_statx;
+
+/* Only the type and the inode are needed, which the file system
+   may be able to return without reading everything */
+static int stat_type(int dfd, const char *name, struct stat *st)
+{
+	struct statx stx;
+
+	stat_inc(ST_STAT);
+	if (!no_statx) {
+		if (statx(dfd, name, AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC,
+			  STATX_TYPE|STATX_INO, &stx) == 0) {
+			st->st_mode = stx.stx_mode;
+			st->st_ino = stx.stx_ino;
+			return 0;
+		}
+		if (errno != ENOSYS)
+			return -1;
+		no_statx = 1;
+	}
+	return fstatat(dfd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+/* Find the type of the DT_UNKNOWN entries from start on, which must
+   be sorted by inode. Directories are queued for the walk and removed
+   from the entries, like readdir with DT_DIR would have done. */
+static void resolve_unknown(struct fastwalk *fw, int start)
+{
+	int i, k, first;
+
+	if (!no_bulkstat) {
+		for (first = start, i = start + 1; i <= fw->numentries; i++) {
+			if (i < fw->numentries && fw->entries[i].dev == fw->entries[first].dev)
+				continue;
+			bulkstat_types(fw, first, i);
+			first = i;
+		}
+	}
+	for (i = start; i < fw->numentries; i++) {
+		struct stat st;
+		int dfd;
+
+		if (fw->entries[i].type != DT_UNKNOWN)
+			continue;
+		dfd = dir_fd(fw, &fw->walk_dirs, fw->entries[i].dir, 0);
+		if (dfd < 0 || stat_type(dfd, fw->names + fw->entries[i].name, &st) < 0) {
+			entry_error(fw, &fw->entries[i]); 
+			continue;
+		}
+		fw->entries[i].type = IFTODT(st.st_mode);
+	}
+	for (k = i = start; i < fw->numentries; i++) {
+		struct entry *e = &fw->entries[i];
+
+		if (e->type == DT_DIR) {
+			queue_dir(fw, add_dname(fw, e->dir, e->name, e->ino), e->ino);
+			continue;
+		}
+		fw->entries[k++] = *e;
+	}
+	fw->numentries = k;
+}
+
+static int entry_before(struct entry *a, struct entry *b)
+{
+	return a->dev < b->dev || (a->dev == b->dev && a->ino < b->ino);
+}
+
+/* Merge the sorted entries from mid on into the sorted ones from 
+   start to mid */
+static void merge_entries(struct fastwalk *fw, int start, int mid)
+{
+	int n = mid - start, i = 0, j = mid, k = start;
+	struct entry *left;
+
+	if (n == 0 || mid == fw->numentries)
+		return;
+	left = xmalloc(n * sizeof(struct entry));
+	memcpy(left, fw->entries + start, n * sizeof(struct entry));
+	while (i < n && j < fw->numentries) {
+		if (entry_before(&fw->entries[j], &left[i]))
+			fw->entries[k++] = fw->entries[j++];
+		else
+			fw->entries[k++] = left[i++];
+	}
+	memcpy(fw->entries + k, left + i, (n - i) * sizeof(struct entry));
+	free(left);
+}
+
+/* Each round of the walk only finds the directories in the unknown 
+   entries of the previous round. Only the new entries are sorted,
+   and then merged into the ones that are already sorted. */
+static void handle_unknown(struct fastwalk *fw)
+{
+	int start = fw->flushed, found;
+
+	fprintf(stderr, "Warning: file system does not support dt_type\n");
+ 
+	do {
+		resolve_unknown(fw, start);
+		merge_entries(fw, fw->flushed, start);
+		start = fw->numentries;
+		found = walk(fw);
+		/* The streaming mode may have processed some already */
+		if (start < fw->flushed)
+			start = fw->flushed;
+		sort_inodes(fw, start);
+	} while (found && !fw->stopped);
+	merge_entries(fw, fw->flushed, start);
+}
+
+static struct extent *get_extents(struct fastwalk *fw, int num)
+{
+	struct extent *e;
+	
+	while (fw->numextents + num > fw->maxextents) { 
+		if (fw->maxextents == 0)
+			fw->maxextents = EXTENTS_START;
+		fw->maxextents *= 2;
+		fw->extents = xrealloc(fw->extents, fw->maxextents * sizeof(struct extent));
+	}
+	e = fw->extents + fw->numextents;
+	fw->numextents += num;
+	return e;
+}
+
+/* With readahead all extents are needed, and for the extent callback.
+   Otherwise the first is enough to sort the files. */
+static int all_extents(struct fastwalk *fw)
+{
+	return fw->do_readahead || (!fw->action && fw->extent_fn);
+}
+
+static unsigned ext_chunks(struct fiemap_extent *fe)
+{
+	if (fe->fe_flags & FIEMAP_EXTENT_UNKNOWN || fe->fe_length == 0)
+		return 1;
+	return (fe->fe_length + EXTENT_MAX - 1) / EXTENT_MAX;
+}
+
+static void save_extents(struct fastwalk *fw, struct fiemap *fie, struct entry *entry)
+{
+	struct extent *e;
+	unsigned i, num, n = fie->fm_mapped_extents;
+	unsigned index = entry - fw->entries;
+	u64 off;
+
+	/* Without readahead only the first extent is needed for sorting */
+	if (!all_extents(fw)) {
+		if (n == 0)
+			memset(&fie->fm_extents[0], 0, sizeof(struct fiemap_extent));
+		n = 1;
+	}
+	num = 0;
+	for (i = 0; i < n; i++)
+		num += all_extents(fw) ? ext_chunks(&fie->fm_extents[i]) : 1;
+
+	/* Other metadata workers may grow the array, so fill it locked */
+	pthread_mutex_lock(&fw->extents_lock);
+	e = get_extents(fw, num);
+	for (i = 0; i < n; i++) { 
+		struct fiemap_extent *fe = &fie->fm_extents[i];
+		if (!all_extents(fw) || (fe->fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
+			memset(e, 0, sizeof(struct extent));
+			if (!(fe->fe_flags & FIEMAP_EXTENT_UNKNOWN))
+				e->disk = fe->fe_physical;
+			e->entry = index;
+			e++;
+			continue;
+		}
+		off = 0;
+		do {
+			e->disk = fe->fe_physical + off;
+			e->offset = fe->fe_logical + off;
+			e->len = fe->fe_length - off > EXTENT_MAX ? 
+				EXTENT_MAX : fe->fe_length - off;
+			e->entry = index;
+			e++;
+			off += EXTENT_MAX;
+		} while (off < fe->fe_length);
+	}
+	pthread_mutex_unlock(&fw->extents_lock);
+	entry->numextents = num;
+}
+
+static struct fiemap *alloc_fiemap(struct fiemap *fie, unsigned count)
+{
+	return xrealloc(fie, sizeof(struct fiemap) + 
+			sizeof(struct fiemap_extent) * count);
+}
+
+/* Get all extents of fd, or NULL when FIEMAP is not supported.
+   Fragmented files need several calls, with a growing buffer. 
+   Without readahead the first is enough, unless the info records
+   need the number. */
+static struct fiemap *get_fiemap(struct fastwalk *fw, int fd, u64 size)
+{
+	int full = all_extents(fw) || fw->infos;
+	unsigned count = full ? FIEMAP_START : 1;
+	struct fiemap *req = NULL, *all = NULL;
+	unsigned n, num = 0;
+	u64 start = 0;
+
+	for (;;) {
+		struct fiemap_extent *last;
+
+		req = alloc_fiemap(req, count);
+		memset(req, 0, sizeof(struct fiemap));
+		req->fm_start = start;
+		req->fm_length = size - start;
+		req->fm_extent_count = count;
+		stat_inc(ST_FIEMAP);
+		if (ioctl(fd, FS_IOC_FIEMAP, req) < 0) {
+			if (!all) {
+				free(req);
+				return NULL;
+			}
+			break;
+		}
+		n = req->fm_mapped_extents;
+		if (n == 0) {
+			if (!all)
+				return req;
+			break;
+		}
+		last = &req->fm_extents[n - 1];
+		if (!all && (n < count || !full || 
+			     (last->fe_flags & FIEMAP_EXTENT_LAST)))
+			return req;	/* common case: all in one call */
+
+		all = alloc_fiemap(all, num + n);
+		memcpy(&all->fm_extents[num], req->fm_extents, 
+		       n * sizeof(struct fiemap_extent));
+		num += n;
+		if (n < count || (last->fe_flags & FIEMAP_EXTENT_LAST))
+			break;
+		start = last->fe_logical + last->fe_length;
+		if (start >= size)
+			break;
+		if (count < FIEMAP_MAX)
+			count *= 2;
+	}
+	free(req);
+	memset(all, 0, sizeof(struct fiemap));
+	all->fm_mapped_extents = num;
+	return all;
+}
+
+/* Extents which continue each other in the file and on disk are
+   read together */
+#define NO_MERGE (FIEMAP_EXTENT_UNKNOWN|FIEMAP_EXTENT_ENCODED| \
+		  FIEMAP_EXTENT_DATA_INLINE|FIEMAP_EXTENT_DATA_TAIL| \
+		  FIEMAP_EXTENT_NOT_ALIGNED)
+
+static void merge_extents(struct fiemap *fie)
+{
+	struct fiemap_extent *fe = fie->fm_extents;
+	unsigned i, k;
+
+	if (fie->fm_mapped_extents == 0)
+		return;
+	for (k = 0, i = 1; i < fie->fm_mapped_extents; i++) {
+		if (!((fe[k].fe_flags | fe[i].fe_flags) & NO_MERGE) &&
+		    fe[k].fe_logical + fe[k].fe_length == fe[i].fe_logical &&
+		    fe[k].fe_physical + fe[k].fe_length == fe[i].fe_physical) {
+			fe[k].fe_length += fe[i].fe_length;
+			fe[k].fe_flags |= fe[i].fe_flags;
+			stat_inc(ST_EXTENTS_MERGED);
+		} else {
+			fe[++k] = fe[i];
+		}
+	}
+	fie->fm_mapped_extents = k + 1;
+}
+
+static void get_disk(struct fastwalk *fw, char *name, int fd, u64 size, struct entry *entry)
+{
+	static int once;
+	struct fiemap *fie;
+	int blk = 0, bsz;
+
+	/* Empty files have no extents, and FIEMAP would reject them */
+	if (size == 0) {
+		fie = alloc_fiemap(NULL, 1);
+		memset(fie, 0, sizeof(struct fiemap));
+		save_extents(fw, fie, entry);
+		free(fie);
+		return;
+	}
+
+	/* If the extents have out of inode contents we will seek here.
+	   No way to avoid that currently */
+
+	fie = get_fiemap(fw, fd, size);
+	if (fie) {
+		if (fie->fm_mapped_extents > 0 &&
+		    (fie->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN)) { 
+			if (!once)
+				fprintf(stderr, "%s: Disk location unknown\n", name); 
+			once = 1;
+		}
+		merge_extents(fie);
+		if (fw->infos)
+			fw->infos[entry - fw->entries].numextents = fie->fm_mapped_extents;
+		save_extents(fw, fie, entry);
+		free(fie);
+		return;
+	}
+	
+	/* Without FIEMAP only the first block is known. Without root not
+	   even that, then sort by size. The whole file is read either way. */
+	fie = alloc_fiemap(NULL, 1);
+	memset(fie, 0, sizeof(struct fiemap) + sizeof(struct fiemap_extent));
+	fie->fm_mapped_extents = 1;
+	fie->fm_extents[0].fe_length = size;
+	stat_inc(ST_FIEMAP);
+	if (ioctl(fd, FIBMAP, &blk) == 0 && ioctl(fd, FIGETBSZ, &bsz) == 0) {
+		fie->fm_extents[0].fe_physical = (u64)blk * bsz;
+	} else {
+		if (errno == EPERM) {
+			if (!once) 
+				fprintf(stderr, 
+					"%s: No FIEMAP and no root: no disk data sorting\n", name);
+			once = 1;
+		}
+		fie->fm_extents[0].fe_physical = size;
+	}
+	if (fw->infos)
+		fw->infos[entry - fw->entries].numextents = 1;
+	save_extents(fw, fie, entry);
+	free(fie);
+}
+
+/* Second pass, done by per device queues with a configurable number
+   of requests in flight. The workers of a queue take the entries in 
+   inode order. */
+
+struct metaq {
+	struct fastwalk *fw;
+	pthread_t *threads;
+	struct entry *entries;
+	int numentries;
+	int next;
+	int depth;
+	int dirfds;
+	int batch;		/* io_uring batch */
+};
+
+struct devdepth {
+	dev_t dev;
+	int depth;
+};
+
+static int set_depth(struct fastwalk *fw, const char *arg)
+{
+	char *path = xstrdup(arg);
+	char *eq = strrchr(path, '=');
+	struct stat st;
+	char *end;
+	int depth, err;
+
+	depth = strtol(eq ? eq + 1 : path, &end, 0);
+	if (*end || depth <= 0) {
+		free(path);
+		errno = EINVAL;
+		return -1;
+	}
+	if (!eq) {
+		fw->default_depth = depth;
+		free(path);
+		return 0;
+	}
+	*eq = 0;
+	err = stat(path, &st) < 0 ? errno : 0;
+	if (err)
+		perror(path);
+	free(path);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	fw->depths = xrealloc(fw->depths, (fw->numdepths + 1) * sizeof(struct devdepth));
+	fw->depths[fw->numdepths].dev = st.st_dev;
+	fw->depths[fw->numdepths].depth = depth;
+	fw->numdepths++;
+	return 0;
+}
+
+/* The kind of storage of each device, looked up once */
+struct devtopo {
+	dev_t dev;
+	struct topology t;
+};
+
+static struct topology *dev_topology(struct fastwalk *fw, dev_t dev)
+{
+	int i;
+
+	for (i = 0; i < fw->numtopos; i++)
+		if (fw->topos[i].dev == dev)
+			return &fw->topos[i].t;
+	fw->topos = xrealloc(fw->topos, (fw->numtopos + 1) * sizeof(struct devtopo));
+	fw->topos[fw->numtopos].dev = dev;
+	get_topology(dev, &fw->topos[fw->numtopos].t);
+	if (fw->debug)
+		fprintf(stderr, "device %u:%u type %d stripes %u chunk %llu\n",
+			major(dev), minor(dev), fw->topos[fw->numtopos].t.type, 
+			fw->topos[fw->numtopos].t.stripes, fw->topos[fw->numtopos].t.chunk);
+	return &fw->topos[fw->numtopos++].t;
+}
+
+/* Without -j a disk gets one request at a time, so that it reads in
+   elevator order. SSDs and RAID arrays get enough to keep them busy */
+static int get_depth(struct fastwalk *fw, dev_t dev)
+{
+	struct topology *t;
+	int i;
+
+	for (i = 0; i < fw->numdepths; i++)
+		if (fw->depths[i].dev == dev)
+			return fw->depths[i].depth;
+	if (fw->default_depth)
+		return fw->default_depth;
+	t = dev_topology(fw, dev);
+	switch (t->type) {
+	case TOPO_SSD:
+		return SSD_DEPTH;
+	case TOPO_RAID:
+		return t->stripes;
+	}
+	return 1;
+}
+
+/* Disk order cache from a previous run (-c). Files whose inode,
+   mtime and size did not change get their extents from the cache
+   instead of FIEMAP. */
+
+/* Files outside the sizes of -z are left out without a stamp, so
+   that the cache does not remember them without their extents */
+static int size_excluded(struct fastwalk *fw, struct entry *e, u64 size)
+{
+	if (size >= fw->min_size && size <= fw->max_size)
+		return 0;
+	e->excluded = 1;
+	return 1;
+}
+
+static void set_stamp(struct fastwalk *fw, struct entry *e, u64 mtime, u64 size)
+{
+	if (fw->infos)
+		fw->infos[e - fw->entries].size = size;
+	if (fw->stamps) {
+		struct stamp *s = &fw->stamps[e - fw->entries];
+		s->mtime = mtime;
+		s->size = size;
+		s->valid = 1;
+	}
+}
+
+static void use_cache_file(struct fastwalk *fw, struct entry *e, struct cache_file *f)
+{
+	struct cache_extent *ce;
+	struct extent *ex;
+	unsigned i, n;
+
+	if (size_excluded(fw, e, f->size))
+		return;
+	n = f->numextents;
+	if (!all_extents(fw) && n > 1)
+		n = 1;
+	ce = &fw->cache.extents[f->extent];
+	pthread_mutex_lock(&fw->extents_lock);
+	ex = get_extents(fw, n);
+	for (i = 0; i < n; i++, ex++, ce++) {
+		ex->disk = ce->disk;
+		ex->offset = ce->offset;
+		ex->len = ce->len;
+		ex->entry = e - fw->entries;
+	}
+	pthread_mutex_unlock(&fw->extents_lock);
+	e->numextents = n;
+	set_stamp(fw, e, f->mtime, f->size);
+	if (fw->infos)
+		fw->infos[e - fw->entries].numextents = f->numextents;
+}
+
+/* Returns 1 when the extents of e were taken from the cache */
+static int cached_extents(struct fastwalk *fw, struct entry *e, u64 mtime, u64 size)
+{
+	struct cache_file *f;
+
+	if (!fw->cache_files_ok)
+		return 0;
+	f = cache_lookup(&fw->cache, fw->devs[e->dev], e->ino);
+	if (!f || f->mtime != mtime || f->size != size)
+		return 0;
+	use_cache_file(fw, e, f);
+	return 1;
+}
+
+static void load_cache(struct fastwalk *fw)
+{
+	if (cache_load(&fw->cache, fw->cachefile) < 0)
+		return;
+	/* A cache without all extents is not good enough for readahead,
+	   but its directories can still be used */
+	/* The extent counts of FASTWALK_INFO need the full extent list too */
+	fw->cache_files_ok = (!all_extents(fw) && !(fw->flags & FASTWALK_INFO)) || 
+		(fw->cache.hdr->flags & CACHE_FULL);
+}
+
+/* Write the cache with the directories that were completely listed
+   in this run, together with their children. The name offsets of the
+   children are into the names arena, which is saved as is. */
+static void save_cache_dirs(struct fastwalk *fw, struct cache_header *hdr, 
+			    struct cache_file *files, struct cache_extent *cext)
+{
+	struct cache_dir *cdirs;
+	struct cache_child *children;
+	struct sortkey *keys;
+	int *first, *count;
+	int i, n, numchildren;
+
+	/* Bucket the children by parent directory */
+	count = xmalloc(fw->numdnames * sizeof(int));
+	memset(count, 0, fw->numdnames * sizeof(int));
+	for (i = 0; i < fw->numentries; i++)
+		if (fw->entries[i].type != DT_DIR)
+			count[fw->entries[i].dir]++;
+	for (i = 0; i < fw->numdnames; i++)
+		if (fw->dnames[i].parent >= 0)
+			count[fw->dnames[i].parent]++;
+	first = xmalloc(fw->numdnames * sizeof(int));
+	numchildren = 0;
+	for (i = 0; i < fw->numdnames; i++) {
+		first[i] = numchildren;
+		if (fw->dstamps[i].valid)
+			numchildren += count[i];
+		count[i] = 0;
+	}
+	children = xmalloc(numchildren * sizeof(struct cache_child));
+	for (i = 0; i < fw->numentries; i++) {
+		struct entry *e = &fw->entries[i];
+		struct cache_child *c;
+		if (e->type == DT_DIR || !fw->dstamps[e->dir].valid)
+			continue;
+		c = &children[first[e->dir] + count[e->dir]++];
+		c->ino = e->ino;
+		c->name = e->name;
+		c->type = e->type;
+	}
+	for (i = 0; i < fw->numdnames; i++) {
+		int p = fw->dnames[i].parent;
+		struct cache_child *c;
+		if (p < 0 || !fw->dstamps[p].valid)
+			continue;
+		c = &children[first[p] + count[p]++];
+		c->ino = fw->dstamps[i].ino;
+		c->name = fw->dnames[i].name;
+		c->type = DT_DIR;
+	}
+
+	keys = xmalloc(fw->numdnames * sizeof(struct sortkey));
+	n = 0;
+	for (i = 0; i < fw->numdnames; i++) {
+		if (!fw->dstamps[i].valid)
+			continue;
+		keys[n].key = fw->dstamps[i].ino;
+		keys[n].index = i;
+		n++;
+	}
+	radix_sort(keys, n);
+	for (i = 0; i < n; i++)
+		keys[i].key = fw->devs[fw->dstamps[keys[i].index].dev];
+	radix_sort(keys, n);
+
+	cdirs = xmalloc(n * sizeof(struct cache_dir));
+	for (i = 0; i < n; i++) {
+		struct dstamp *ds = &fw->dstamps[keys[i].index];
+		struct cache_dir *d = &cdirs[i];
+
+		d->dev = fw->devs[ds->dev];
+		d->ino = ds->ino;
+		d->mtime = ds->mtime;
+		d->ctime = ds->ctime;
+		d->child = first[keys[i].index];
+		d->numchildren = count[keys[i].index];
+	}
+	hdr->numdirs = n;
+	hdr->numchildren = numchildren;
+	if (cache_write(fw->cachefile, hdr, files, cext, cdirs, children, fw->names) < 0)
+		Perror(fw, fw->cachefile);
+
+	free(cdirs);
+	free(keys);
+	free(children);
+	free(first);
+	free(count);
+}
+
+/* Must be called before the extents are sorted, while the extents
+   of each entry are still next to each other. */
+static void save_cache(struct fastwalk *fw)
+{
+	struct cache_header hdr;
+	struct cache_file *files;
+	struct cache_extent *cext;
+	struct sortkey *keys;
+	int *first;
+	int i, n, next;
+
+	first = xmalloc(fw->numentries * sizeof(int));
+	for (i = fw->numextents - 1; i >= 0; i--)
+		first[fw->extents[i].entry] = i;
+
+	keys = xmalloc(fw->numentries * sizeof(struct sortkey));
+	n = 0;
+	for (i = 0; i < fw->numentries; i++) {
+		if (!fw->stamps[i].valid)
+			continue;
+		keys[n].key = fw->entries[i].ino;
+		keys[n].index = i;
+		n++;
+	}
+	radix_sort(keys, n);
+	for (i = 0; i < n; i++)
+		keys[i].key = fw->devs[fw->entries[keys[i].index].dev];
+	radix_sort(keys, n);
+
+	files = xmalloc(n * sizeof(struct cache_file));
+	cext = xmalloc(fw->numextents * sizeof(struct cache_extent));
+	next = 0;
+	for (i = 0; i < n; i++) {
+		unsigned index = keys[i].index;
+		struct entry *e = &fw->entries[index];
+		struct cache_file *f = &files[i];
+		unsigned k;
+
+		f->dev = fw->devs[e->dev];
+		f->ino = e->ino;
+		f->mtime = fw->stamps[index].mtime;
+		f->size = fw->stamps[index].size;
+		f->extent = next;
+		f->numextents = e->numextents;
+		for (k = 0; k < e->numextents; k++, next++) {
+			struct extent *ex = &fw->extents[first[index] + k];
+			cext[next].disk = ex->disk;
+			cext[next].offset = ex->offset;
+			cext[next].len = ex->len;
+			cext[next].pad = 0;
+		}
+	}
+
+	memset(&hdr, 0, sizeof(struct cache_header));
+	hdr.flags = all_extents(fw) ? CACHE_FULL : 0;
+	hdr.numfiles = n;
+	hdr.numextents = next;
+	hdr.skiphash = fw->skiphash;
+	hdr.namesize = fw->numnames;
+	save_cache_dirs(fw, &hdr, files, cext);
+
+	free(files);
+	free(cext);
+	free(keys);
+	free(first);
+}
+
+/* The fds of the metadata pass are handed to the readahead pass,
+   as far as the fd budget allows. */
+
+/* Returns 1 when fd was kept for the readahead of e */
+static int keep_fd(struct fastwalk *fw, struct entry *e, int fd)
+{
+	if (e->excluded || 
+	    (!fw->action && (!fw->do_readahead || e->numextents == 0 || e->resident)))
+		return 0;
+	if (__atomic_add_fetch(&fw->kept_fds, 1, __ATOMIC_RELAXED) > fw->max_kept) {
+		__atomic_sub_fetch(&fw->kept_fds, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	e->rawfd = fd;
+	e->kept = 1;
+	return 1;
+}
+
+/* Close what the readahead pass did not use */
+static void close_kept(struct fastwalk *fw, int start)
+{
+	int i;
+
+	for (i = start; i < fw->numentries; i++) {
+		if (fw->entries[i].kept) {
+			close(fw->entries[i].rawfd);
+			stat_inc(ST_CLOSE);
+			fw->entries[i].kept = 0;
+			fw->entries[i].fd = NULL;
+			fw->kept_fds--;
+		}
+	}
+}
+
+/* Files that are completely in the page cache need neither FIEMAP
+   nor readahead. cachestat is cheapest, older kernels need mincore 
+   on a mapping of the file. */
+
+#ifndef __NR_cachestat
+#define __NR_cachestat 451
+#endif
+
+struct cs_range {
+	u64 off;
+	u64 len;
+};
+
+struct cs_stat {
+	u64 nr_cache;
+	u64 nr_dirty;
+	u64 nr_writeback;
+	u64 nr_evicted;
+	u64 nr_recently_evicted;
+};
+
+static int no_cachestat;
+
+/* Pages of off to off + len in the page cache, off page aligned.
+   With all mincore stops at the first missing page. */
+static u64 resident_pages(int fd, u64 off, u64 len, int all)
+{
+	u64 psz = sysconf(_SC_PAGESIZE);
+	struct cs_range range = { off, len };
+	struct cs_stat cs;
+	unsigned char vec[MINCORE_VEC];
+	u64 pos, n = 0;
+	char *map;
+
+	stat_inc(ST_RESIDENT);
+	if (!no_cachestat) {
+		if (syscall(__NR_cachestat, fd, &range, &cs, 0) == 0)
+			return cs.nr_cache;
+		if (errno == ENOSYS)
+			no_cachestat = 1;
+	}
+
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off);
+	if (map == MAP_FAILED)
+		return 0;
+	for (pos = 0; pos < len; pos += MINCORE_VEC * psz) {
+		u64 l = len - pos;
+		unsigned i, k;
+
+		if (l > MINCORE_VEC * psz)
+			l = MINCORE_VEC * psz;
+		k = (l + psz - 1) / psz;
+		if (mincore(map + pos, l, vec) < 0)
+			break;
+		for (i = 0; i < k; i++)
+			n += vec[i] & 1;
+		if (all && n < (pos + l + psz - 1) / psz)
+			break;
+	}
+	munmap(map, len);
+	return n;
+}
+
+static int file_resident(int fd, u64 size)
+{
+	u64 psz = sysconf(_SC_PAGESIZE);
+	u64 pages = (size + psz - 1) / psz;
+
+	if (size == 0)
+		return 0;
+	return resident_pages(fd, 0, size, 1) >= pages;
+}
+
+/* How much of len bytes at off is in the page cache */
+static u64 resident_bytes(int fd, u64 off, u64 len)
+{
+	u64 psz = sysconf(_SC_PAGESIZE);
+	u64 start = off & ~(psz - 1);
+	u64 pages = (off + len - start + psz - 1) / psz;
+	u64 n;
+
+	if (len == 0)
+		return 0;
+	n = resident_pages(fd, start, off + len - start, 0);
+	if (n >= pages || n * psz > len)
+		return len;
+	return n * psz;
+}
+
+/* Get the extents of an open file, unless the cache has them. With
+   readahead resident files are marked and dropped from the readahead
+   later. They are not mapped, unless the cache maps them for free. */
+static void map_file(struct fastwalk *fw, struct entry *e, int fd, u64 mtime, u64 size, 
+		     int cache_checked)
+{
+	int resident;
+
+	if (size_excluded(fw, e, size))
+		return;
+	/* Cached now is not cached at the next iteration */
+	resident = fw->do_readahead && !(fw->flags & FASTWALK_REPEAT) &&
+		file_resident(fd, size);
+
+	if (resident) {
+		e->resident = 1;
+		stat_inc(ST_FILES_RESIDENT);
+	}
+	if (!cache_checked && cached_extents(fw, e, mtime, size))
+		return;
+	if (resident)
+		return;
+	get_disk(fw, fw->names + e->name, fd, size, e);
+	set_stamp(fw, e, mtime, size);
+}
+
+/* With readahead the file has to be opened anyway, so open it first
+   and fstat the fd. Otherwise stat it first and only open it when
+   it is not in the cache. Files in unchanged directories (-i) are
+   likely in the cache, so they are always stat'ed first. */
+static int open_first(struct fastwalk *fw, struct entry *e)
+{
+	if (!fw->cache_files_ok)
+		return 1;
+	return !e->trusted && (fw->do_readahead || fw->action);
+}
+
+static void get_disk_entry(struct fastwalk *fw, struct dircache *c, struct entry *e)
+{
+	struct stat st;
+	char *name = fw->names + e->name;
+	int fd, dfd, have_st = 0;
+	u64 mtime;
+
+	dfd = dir_fd(fw, c, e->dir, 0);
+	if (dfd < 0) {
+		entry_error(fw, e);
+		return;
+	}
+	if (!open_first(fw, e)) {
+		stat_inc(ST_STAT);
+		if (fstatat(dfd, name, &st, 0) < 0) {
+			entry_error(fw, e);
+			return;
+		}
+		if (cached_extents(fw, e, ts_ns(st.st_mtim.tv_sec, 
+					    st.st_mtim.tv_nsec), st.st_size))
+			return;
+		have_st = 1;
+	}
+	fd = openat(dfd, name, O_RDONLY);
+	stat_inc(ST_OPEN);
+	if (!have_st)
+		stat_inc(ST_STAT);
+	if (fd < 0 || (!have_st && fstat(fd, &st) < 0)) {
+		entry_error(fw, e);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	mtime = ts_ns(st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+	map_file(fw, e, fd, mtime, st.st_size, have_st);
+	if (!keep_fd(fw, e, fd)) {
+		close(fd);
+		stat_inc(ST_CLOSE);
+	}
+}
+
+/* io_uring version of the metadata pass: the statx, open and close
+   of a batch of files are each submitted with a single system call.
+   The FIEMAP ioctl has no io_uring equivalent and stays synchronous. */
+
+struct meta_op {
+	struct entry *e;
+	int dfd;
+	int fd;
+	int err;
+	int cached;
+	int first;		/* opened before the statx */
+	struct statx stx;
+};
+
+static void meta_done(struct io_uring_cqe *cqe, void *arg)
+{
+	struct meta_op *op = (struct meta_op *)arg + (cqe->user_data >> 1);
+
+	if (cqe->user_data & 1) {
+		if (cqe->res < 0 && !op->err)
+			op->err = -cqe->res;
+	} else if (cqe->res < 0) {
+		op->err = -cqe->res;
+	} else {
+		op->fd = cqe->res;
+	}
+}
+
+static void close_done(struct io_uring_cqe *cqe, void *arg)
+{
+	struct meta_op *op = (struct meta_op *)arg + cqe->user_data;
+	op->fd = -1;
+}
+
+static int uring_failed(int err)
+{
+	static int once;
+	if (err < 0 && !once++)
+		fprintf(stderr, "io_uring: %s\n", strerror(-err));
+	return err < 0;
+}
+
+static void prep_open(struct fastwalk *fw, struct uring *r, struct meta_op *op, int k)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+	stat_inc(ST_OPEN);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = op->dfd;
+	sqe->addr = (unsigned long)(fw->names + op->e->name);
+	sqe->open_flags = O_RDONLY;
+	sqe->user_data = k << 1;
+}
+
+/* On the fd when it is already open, otherwise by name */
+static void prep_statx(struct fastwalk *fw, struct uring *r, struct meta_op *op, int k)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+	stat_inc(ST_STAT);
+	sqe->opcode = IORING_OP_STATX;
+	if (op->fd >= 0) {
+		sqe->fd = op->fd;
+		sqe->addr = (unsigned long)"";
+		sqe->statx_flags = AT_EMPTY_PATH;
+	} else {
+		sqe->fd = op->dfd;
+		sqe->addr = (unsigned long)(fw->names + op->e->name);
+	}
+	sqe->len = STATX_SIZE|STATX_MTIME;
+	sqe->off = (unsigned long)&op->stx;
+	sqe->user_data = (k << 1) | 1;
+}
+
+static void metadata_worker_uring(struct fastwalk *fw, struct metaq *q, struct uring *r,
+				  struct dircache *c)
+{
+	struct meta_op *ops = xmalloc(sizeof(struct meta_op) * q->batch);
+	struct io_uring_sqe *sqe;
+	int i, k, n, start;
+
+	while ((start = __atomic_fetch_add(&q->next, q->batch, 
+					   __ATOMIC_RELAXED)) < q->numentries) {
+		n = 0;
+		for (i = start; i < q->numentries && i < start + q->batch; i++) {
+			struct entry *e = &q->entries[i];
+			if (e->type != DT_REG || e->excluded)
+				continue;
+			ops[n].e = e;
+			ops[n].fd = -1;
+			ops[n].err = 0;
+			ops[n].cached = 0;
+			ops[n].first = open_first(fw, e);
+			ops[n].dfd = dir_fd(fw, c, e->dir, 1);
+			if (ops[n].dfd < 0) {
+				ops[n++].err = errno;
+				continue;
+			}
+			if (ops[n].first)
+				prep_open(fw, r, &ops[n], n);
+			else
+				prep_statx(fw, r, &ops[n], n);
+			n++;
+		}
+		if (uring_failed(uring_submit_and_reap(r, meta_done, ops))) {
+			/* Finish the batch synchronously */
+			unpin_dirfds(c);
+			for (k = 0; k < n; k++) {
+				if (ops[k].fd >= 0)
+					close(ops[k].fd);
+				get_disk_entry(fw, c, ops[k].e);
+			}
+			continue;
+		}
+
+		/* Either fstat what was opened, or open what is not 
+		   in the cache */
+		for (k = 0; k < n; k++) {
+			struct meta_op *op = &ops[k];
+			if (op->err)
+				continue;
+			if (op->first) {
+				prep_statx(fw, r, op, k);
+				continue;
+			}
+			op->cached = cached_extents(fw, op->e, 
+				ts_ns(op->stx.stx_mtime.tv_sec, op->stx.stx_mtime.tv_nsec),
+				op->stx.stx_size);
+			if (!op->cached)
+				prep_open(fw, r, op, k);
+		}
+		if (uring_failed(uring_submit_and_reap(r, meta_done, ops))) {
+			unpin_dirfds(c);
+			for (k = 0; k < n; k++) {
+				if (ops[k].fd >= 0)
+					close(ops[k].fd);
+				if (!ops[k].cached)
+					get_disk_entry(fw, c, ops[k].e);
+			}
+			continue;
+		}
+		unpin_dirfds(c);
+
+		for (k = 0; k < n; k++) {
+			struct meta_op *op = &ops[k];
+			u64 mtime = ts_ns(op->stx.stx_mtime.tv_sec, 
+					  op->stx.stx_mtime.tv_nsec);
+			if (op->err) {
+				errno = op->err;
+				entry_error(fw, op->e);
+			} else {
+				if (!op->cached)
+					map_file(fw, op->e, op->fd, mtime, 
+						 op->stx.stx_size, !op->first);
+				if (op->fd >= 0 && keep_fd(fw, op->e, op->fd))
+					op->fd = -1;
+			}
+			if (op->fd >= 0) {
+				sqe = uring_get_sqe(r);
+				stat_inc(ST_CLOSE);
+				sqe->opcode = IORING_OP_CLOSE;
+				sqe->fd = op->fd;
+				sqe->user_data = k;
+			}
+		}
+		if (uring_failed(uring_submit_and_reap(r, close_done, ops)))
+			for (k = 0; k < n; k++)
+				if (ops[k].fd >= 0)
+					close(ops[k].fd);
+	}
+	free(ops);
+}
+
+static void *metadata_worker(void *arg)
+{
+	struct metaq *q = arg;
+	struct fastwalk *fw = q->fw;
+	struct dircache c;
+	struct uring r;
+	int i;
+
+	init_dirfds(&c, q->dirfds);
+	if (fw->use_uring && !uring_failed(uring_init(&r, 2 * URING_BATCH))) {
+		metadata_worker_uring(fw, q, &r, &c);
+		uring_exit(&r);
+	}
+
+	while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < 
+	       q->numentries) {
+		if (q->entries[i].type == DT_REG && !q->entries[i].excluded)
+			get_disk_entry(fw, &c, &q->entries[i]);
+	}
+	exit_dirfds(&c);
+	return NULL;
+}
+
+/* Split ents, which must be sorted by device, into one queue per
+   device and run worker with the -j depth of threads on each.
+   The fds threads share the fd budget. */
+static void run_queues(struct fastwalk *fw, struct entry *ents, int num,
+		       int fds, void *(*worker)(void *))
+{
+	struct metaq *queues;
+	int i, j, start, n, nqueues = 0, nthreads = 0;
+
+	for (i = 0; i < num; i++)
+		if (i == 0 || ents[i].dev != ents[i-1].dev)
+			nqueues++;
+	if (nqueues == 0)
+		return;
+	queues = xmalloc(sizeof(struct metaq) * nqueues);
+
+	n = 0;
+	for (start = 0, i = 1; i <= num; i++) {
+		if (i < num && ents[i].dev == ents[start].dev)
+			continue;
+		queues[n].fw = fw;
+		queues[n].entries = ents + start;
+		queues[n].numentries = i - start;
+		queues[n].next = 0;
+		queues[n].depth = get_depth(fw, fw->devs[ents[start].dev]);
+		queues[n].threads = xmalloc(sizeof(pthread_t) * queues[n].depth);
+		nthreads += queues[n].depth;
+		n++;
+		start = i;
+	}
+	/* Each thread needs a few fds; with a low limit shed threads
+	   from the deepest queue */
+	while (nthreads > nqueues && fds / nthreads < WORKER_FDS) {
+		struct metaq *q = &queues[0];
+		for (i = 1; i < nqueues; i++)
+			if (queues[i].depth > q->depth)
+				q = &queues[i];
+		q->depth--;
+		nthreads--;
+	}
+	/* A batch has up to batch files and pinned directories open */
+	for (i = 0; i < nqueues; i++) {
+		int share = fds / nthreads;
+		struct metaq *q = &queues[i];
+
+		q->dirfds = dirfd_share(share);
+		q->batch = (share - q->dirfds) / 2;
+		if (q->batch > URING_BATCH)
+			q->batch = URING_BATCH;
+		if (q->batch < 1)
+			q->batch = 1;
+	}
+
+	if (nthreads == 1) {
+		worker(&queues[0]);
+	} else {
+		for (i = 0; i < nqueues; i++) {
+			struct metaq *q = &queues[i];
+			for (j = 0; j < q->depth; j++) {
+				int err = pthread_create(&q->threads[j], NULL, 
+							 worker, q);
+				if (err) {
+					fprintf(stderr, "pthread_create: %s\n", 
+						strerror(err));
+					break;
+				}
+			}
+			/* Also handles no thread started */
+			if (j < q->depth) 
+				worker(q);
+			q->depth = j;
+		}
+		for (i = 0; i < nqueues; i++)
+			for (j = 0; j < queues[i].depth; j++)
+				pthread_join(queues[i].threads[j], NULL);
+	}
+
+	for (i = 0; i < nqueues; i++)
+		free(queues[i].threads);
+	free(queues);
+}
+
+/* Entries must be sorted by device and inode */
+static void do_metadata_pass(struct fastwalk *fw, struct entry *ents, int num)
+{
+	/* Half of the fds can be kept open for the next pass */
+	fw->max_kept = fw->do_readahead || fw->action ? (fd_budget(fw) - fw->kept_fds) / 2 : 0;
+	run_queues(fw, ents, num, fd_budget(fw) - fw->max_kept, metadata_worker);
+}
+
+/* LRU for file descriptors. Each readahead worker has its own. */
+
+struct worker {
+	struct fastwalk *fw;
+	pthread_t thread;
+	struct extent *extents;
+	int numextents;
+	struct list_head lru;
+	struct fd *fds;
+	int free_fd, max_fd;
+	struct dircache dirs;
+	u64 last_end;		/* of the previous read on disk, for -s */
+	char *buf;		/* for the reads of -R */
+};
+
+/* The directory fds come out of the same budget, twice to allow
+   for the pinned ones of an io_uring batch, and so does the ring */
+static void init_fd(struct fastwalk *fw, struct worker *w, int max_fd)
+{
+	init_dirfds(&w->dirs, dirfd_share(max_fd));
+	max_fd -= 2 * w->dirs.max + fw->use_uring;
+	INIT_LIST_HEAD(&w->lru);
+	w->max_fd = max_fd > 0 ? max_fd : 1;
+	w->free_fd = 0;
+	w->last_end = 0;
+	w->fds = xmalloc(sizeof(struct fd) * w->max_fd);
+	w->buf = NULL;
+	if (fw->populate &&
+	    posix_memalign((void **)&w->buf, sysconf(_SC_PAGESIZE), POPULATE_BUF))
+		oom();
+}
+
+static void do_close_fd(struct fd *fd)
+{
+	close(fd->fd);
+	stat_inc(ST_CLOSE);
+	fd->entry->fd = NULL;
+	fd->entry = NULL;
+}
+
+static struct fd *get_unused_fd(struct worker *w)
+{
+	struct fd *fd;
+	if (w->free_fd < w->max_fd)
+		return &w->fds[w->free_fd++];
+	assert(!list_empty(&w->lru));
+	fd = list_entry(w->lru.prev, struct fd, lru);
+	list_del(&fd->lru);
+	if (fd->entry) {
+		stat_inc(ST_FD_EVICT);
+		do_close_fd(fd);
+	}
+	return fd;
+}
+
+/* Put a fd kept by the metadata pass into the LRU */
+static void adopt_fd(struct fastwalk *fw, struct worker *w, struct entry *e)
+{
+	struct fd *fd;
+	int rawfd = e->rawfd;
+
+	if (!e->kept)
+		return;
+	e->kept = 0;
+	e->fd = NULL;
+	__atomic_sub_fetch(&fw->kept_fds, 1, __ATOMIC_RELAXED);
+	fd = get_unused_fd(w);
+	fd->fd = rawfd;
+	fd->entry = e;
+	e->fd = fd;
+	list_add(&fd->lru, &w->lru);
+}
+
+static struct fd *get_fd(struct fastwalk *fw, struct worker *w, struct entry *e)
+{
+	struct fd *fd;
+
+	adopt_fd(fw, w, e);
+	fd = e->fd;
+	if (fd) {
+		stat_inc(ST_FD_HIT);
+		list_del(&fd->lru);
+	} else {
+		int dfd = dir_fd(fw, &w->dirs, e->dir, 0);
+
+		stat_inc(ST_FD_MISS);
+		stat_inc(ST_OPEN);
+		fd = get_unused_fd(w);
+		fd->fd = dfd >= 0 ? openat(dfd, fw->names + e->name, O_RDONLY) : -1;
+		if (fd->fd < 0) { 
+			fd->entry = NULL;
+			list_add_tail(&fd->lru, &w->lru);
+			return NULL;
+		} else { 
+			e->fd = fd;
+		}
+		fd->entry = e;
+	}
+	list_add(&fd->lru, &w->lru);
+	return fd;
+}
+
+static void close_fd(struct worker *w, struct fd *fd)
+{
+	do_close_fd(fd);
+	list_del(&fd->lru);
+	list_add_tail(&fd->lru, &w->lru);
+}
+
+/* Without a memory budget a tree larger than the page cache would 
+   evict its own beginning. Returns how much of len may still be read.
+   Shared by all readahead workers and over all batches. */
+static unsigned budget_read(struct fastwalk *fw, unsigned len)
+{
+	u64 old = __atomic_fetch_add(&fw->read_bytes, len, __ATOMIC_RELAXED);
+	static int once;
+
+	if (!fw->max_bytes || old + len <= fw->max_bytes)
+		return len;
+	if (fw->debug && !once++)
+		fprintf(stderr, "readahead budget of %llu bytes reached\n", 
+			fw->max_bytes);
+	if (old >= fw->max_bytes)
+		return 0;
+	return fw->max_bytes - old;
+}
+
+static int budget_done(struct fastwalk *fw)
+{
+	return fw->max_bytes && 
+		__atomic_load_n(&fw->read_bytes, __ATOMIC_RELAXED) >= fw->max_bytes;
+}
+
+/* Consumer paced readahead (-w): the readahead stays at most window
+   bytes ahead of the files the consumer actually read. Files it read
+   already are not read ahead anymore. Once the consumer is finished
+   the readahead stops. */
+
+struct window_slot {
+	dev_t dev;
+	u64 ino;
+	int entry;		/* -1 for empty */
+};
+
+static unsigned window_slot(struct fastwalk *fw, dev_t dev, u64 ino)
+{
+	return ((u64)dev * 0x9e3779b97f4a7c15ULL ^ ino) & (fw->window_size - 1);
+}
+
+static void consume(void *arg, dev_t dev, ino_t ino, int done)
+{
+	struct fastwalk *fw = arg;
+	unsigned i;
+
+	pthread_mutex_lock(&fw->window_lock);
+	if (done) {
+		fw->consumer_done = 1;
+	} else if (fw->window_size) {
+		for (i = window_slot(fw, dev, ino); fw->window_hash[i].entry >= 0; 
+		     i = (i + 1) & (fw->window_size - 1)) {
+			int e = fw->window_hash[i].entry;
+			if (fw->window_hash[i].dev != dev || fw->window_hash[i].ino != ino)
+				continue;
+			if (!fw->consumed[e]) {
+				fw->consumed[e] = 1;
+				fw->outstanding -= fw->issued[e];
+				fw->issued[e] = 0;
+			}
+			break;
+		}
+	}
+	pthread_cond_broadcast(&fw->window_cond);
+	pthread_mutex_unlock(&fw->window_lock);
+}
+
+/* Make the files of a readahead pass known to the consumer tracking */
+static void window_start(struct fastwalk *fw, struct extent *exts, int num)
+{
+	int i;
+
+	pthread_mutex_lock(&fw->window_lock);
+	if (fw->numentries > fw->maxconsumed) {
+		fw->issued = xrealloc(fw->issued, fw->numentries * sizeof(u64));
+		fw->consumed = xrealloc(fw->consumed, fw->numentries);
+		memset(fw->issued + fw->maxconsumed, 0, 
+		       (fw->numentries - fw->maxconsumed) * sizeof(u64));
+		memset(fw->consumed + fw->maxconsumed, 0, fw->numentries - fw->maxconsumed);
+		fw->maxconsumed = fw->numentries;
+	}
+	free(fw->window_hash);
+	for (fw->window_size = 1; fw->window_size < 2 * num; fw->window_size *= 2)
+		;
+	fw->window_hash = xmalloc(fw->window_size * sizeof(struct window_slot));
+	for (i = 0; i < fw->window_size; i++)
+		fw->window_hash[i].entry = -1;
+	for (i = 0; i < num; i++) {
+		struct entry *e = ext_entry(fw, &exts[i]);
+		unsigned k = window_slot(fw, fw->devs[e->dev], e->ino);
+
+		while (fw->window_hash[k].entry >= 0 && 
+		       fw->window_hash[k].entry != e - fw->entries)
+			k = (k + 1) & (fw->window_size - 1);
+		fw->window_hash[k].dev = fw->devs[e->dev];
+		fw->window_hash[k].ino = e->ino;
+		fw->window_hash[k].entry = e - fw->entries;
+	}
+	pthread_mutex_unlock(&fw->window_lock);
+
+	if (!fw->progress && !fw->consumer_done) {
+		int n = 0;
+		char **roots = xmalloc(fw->numdnames * sizeof(char *));
+
+		for (i = 0; i < fw->numdnames; i++)
+			if (fw->dnames[i].parent < 0)
+				roots[n++] = fw->names + fw->dnames[i].name;
+		fw->progress = progress_start(fw->progress_list, roots, n,
+					      consume, fw);
+		free(roots);
+		/* Without a consumer nothing may be read ahead */
+		if (!fw->progress) {
+			Perror(fw, fw->progress_list ? fw->progress_list : "fanotify");
+			fw->consumer_done = 1;
+		}
+	}
+}
+
+/* Wait until len more bytes of e fit into the window. Returns 1 to
+   read them, 0 when e was consumed already, -1 when the consumer 
+   is finished. Without block -2 when it would have to wait. */
+static int window_wait(struct fastwalk *fw, struct entry *e, unsigned len, int block)
+{
+	int i = e - fw->entries, ret;
+
+	pthread_mutex_lock(&fw->window_lock);
+	while (!fw->consumer_done && !fw->consumed[i] && fw->outstanding > 0 &&
+	       fw->outstanding + len > fw->window) {
+		if (!block) {
+			pthread_mutex_unlock(&fw->window_lock);
+			return -2;
+		}
+		pthread_cond_wait(&fw->window_cond, &fw->window_lock);
+	}
+	ret = fw->consumer_done ? -1 : fw->consumed[i] ? 0 : 1;
+	if (ret > 0) {
+		fw->outstanding += len;
+		fw->issued[i] += len;
+	}
+	pthread_mutex_unlock(&fw->window_lock);
+	return ret;
+}
+
+/* Populate (-R): readahead is only a hint, which the kernel may cut
+   short or drop under memory pressure, and it returns before the data
+   is read. Reading the data into a scratch buffer returns only once
+   it is in the page cache. Afterwards count how much of it stayed. */
+static void populate(struct fastwalk *fw, struct worker *w, struct entry *e,
+		     int fd, struct extent *ex, unsigned len)
+{
+	u64 off = ex->offset, end = ex->offset + len, n;
+	ssize_t ret;
+
+	while (off < end) {
+		n = end - off < POPULATE_BUF ? end - off : POPULATE_BUF;
+		ret = pread(fd, w->buf, n, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			entry_error(fw, e);
+			break;
+		}
+		stat_inc(ST_READ);
+		stat_add(ST_READ_BYTES, ret);
+		off += ret;
+		/* The last extent usually goes past the end of the file */
+		if (ret < n)
+			break;
+	}
+	n = resident_bytes(fd, ex->offset, off - ex->offset);
+	__atomic_add_fetch(&fw->populated, n, __ATOMIC_RELAXED);
+	stat_add(ST_POPULATED_BYTES, n);
+}
+
+/* Close what is still open when the worker stopped early */
+static void close_all_fds(struct worker *w)
+{
+	int i;
+
+	for (i = 0; i < w->free_fd; i++)
+		if (w->fds[i].entry)
+			do_close_fd(&w->fds[i]);
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(r);
+	if (!sqe) { 
+		uring_failed(uring_submit(r, 0));
+		sqe = uring_get_sqe(r);
+	}
+	return sqe;
+}
+
+static void open_done(struct io_uring_cqe *cqe, void *arg)
+{
+	struct fastwalk *fw = arg;
+	struct fd *fd = (struct fd *)(unsigned long)cqe->user_data;
+	if (cqe->res >= 0) {
+		fd->fd = cqe->res;
+	} else if (fd->entry) {
+		errno = -cqe->res;
+		entry_error(fw, fd->entry);
+		fd->entry->fd = NULL;
+		fd->entry = NULL;
+	}
+}
+
+static void fadvise_done(struct io_uring_cqe *cqe, void *arg)
+{
+}
+
+/* io_uring version of the third pass: the opens, fadvise(WILLNEED)
+   and closes of a batch of extents are each submitted together, 
+   in disk order. With -R the extents are then read, which mostly
+   waits for the reads the fadvise started. */
+static void readahead_worker_uring(struct fastwalk *fw, struct worker *w, struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned lens[URING_BATCH];	/* read ahead of each extent */
+	int i, k, end, batch, err;
+
+	batch = w->max_fd / 2;
+	if (batch > URING_BATCH)
+		batch = URING_BATCH;
+	if (batch > w->dirs.max)
+		batch = w->dirs.max;
+	if (batch < 1)
+		batch = 1;
+
+	for (i = 0; i < w->numextents; i = end) {
+		int brk = 0, stop = 0;
+
+		if (budget_done(fw)) {
+			i = w->numextents;
+			break;
+		}
+
+		/* End the batch at the last run break that fits */
+		for (end = i + 1; end < w->numextents && end - i < batch; end++)
+			if (run_break(fw, &w->extents[end - 1], &w->extents[end]))
+				brk = end;
+		if (end < w->numextents && brk && 
+		    !run_break(fw, &w->extents[end - 1], &w->extents[end]))
+			end = brk;
+
+		for (k = i; k < end; k++) {
+			struct entry *e = ext_entry(fw, &w->extents[k]);
+			struct fd *fd;
+			int dfd;
+
+			adopt_fd(fw, w, e);
+			fd = e->fd;
+			if (fd) {
+				stat_inc(ST_FD_HIT);
+				list_del(&fd->lru);
+				list_add(&fd->lru, &w->lru);
+				continue;
+			}
+			stat_inc(ST_FD_MISS);
+			dfd = dir_fd(fw, &w->dirs, e->dir, 1);
+			if (dfd < 0) {
+				entry_error(fw, e);
+				continue;
+			}
+			fd = get_unused_fd(w);
+			fd->fd = -1;
+			fd->entry = e;
+			e->fd = fd;
+			list_add(&fd->lru, &w->lru);
+			sqe = get_sqe(r);
+			stat_inc(ST_OPEN);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = dfd;
+			sqe->addr = (unsigned long)(fw->names + e->name);
+			sqe->open_flags = O_RDONLY;
+			sqe->user_data = (unsigned long)fd;
+		}
+		err = uring_submit_and_reap(r, open_done, fw);
+		unpin_dirfds(&w->dirs);
+		if (uring_failed(err)) {
+			for (k = i; k < end; k++) {
+				struct fd *fd = ext_entry(fw, &w->extents[k])->fd;
+				if (fd && fd->fd < 0) {
+					fd->entry->fd = NULL;
+					fd->entry = NULL;
+				}
+			}
+			break;
+		}
+
+		memset(lens, 0, sizeof lens);
+		for (k = i; k < end && !stop; k++) {
+			struct extent *ex = &w->extents[k];
+			struct fd *fd = ext_entry(fw, ex)->fd;
+			unsigned len;
+
+			/* Length 0 would be the whole file for fadvise */
+			if (!fd || ex->len == 0)
+				continue;
+			if (fw->window) {
+				int ret = window_wait(fw, ext_entry(fw, ex), ex->len, 0);
+
+				/* Don't sit on the reads before waiting */
+				if (ret == -2) {
+					if (uring_failed(uring_submit_and_reap(r,
+							fadvise_done, NULL)))
+						break;
+					ret = window_wait(fw, ext_entry(fw, ex), ex->len, 1);
+				}
+				if (ret < 0) {
+					stop = 1;
+					break;
+				}
+				if (ret == 0)
+					continue;
+			}
+			len = budget_read(fw, ex->len);
+			stop = len < ex->len;
+			if (len == 0)
+				break;
+			sqe = get_sqe(r);
+			stat_inc(ST_READAHEAD);
+			stat_add(ST_READAHEAD_BYTES, len);
+			stats_seek(&w->last_end, ex->disk, len);
+			sqe->opcode = IORING_OP_FADVISE;
+			sqe->fd = fd->fd;
+			sqe->off = ex->offset;
+			sqe->len = len;
+			sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+			lens[k - i] = len;
+		}
+		if (uring_failed(uring_submit_and_reap(r, fadvise_done, NULL)))
+			break;
+		for (k = i; k < end && fw->populate; k++) {
+			struct entry *e = ext_entry(fw, &w->extents[k]);
+
+			if (lens[k - i])
+				populate(fw, w, e, e->fd->fd, &w->extents[k], lens[k - i]);
+		}
+
+		for (k = i; k < end; k++) {
+			struct entry *e = ext_entry(fw, &w->extents[k]);
+			struct fd *fd = e->fd;
+			if (--e->numextents > 0 || !fd)
+				continue;
+			sqe = get_sqe(r);
+			stat_inc(ST_CLOSE);
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = fd->fd;
+			e->fd = NULL;
+			fd->entry = NULL;
+			list_del(&fd->lru);
+			list_add_tail(&fd->lru, &w->lru);
+		}
+		if (uring_failed(uring_submit_and_reap(r, fadvise_done, NULL))) {
+			i = end;
+			break;
+		}
+		if (stop) {
+			i = w->numextents;
+			break;
+		}
+	}
+
+	/* On errors fall back to synchronous readahead for the rest */
+	w->extents += i;
+	w->numextents -= i;
+}
+
+/* Third pass for a single device: read the data in disk order */
+static void *readahead_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct fastwalk *fw = w->fw;
+	struct uring r;
+	int i;
+
+	if (fw->use_uring && !uring_failed(uring_init(&r, 4 * URING_BATCH))) {
+		readahead_worker_uring(fw, w, &r);
+		uring_exit(&r);
+	}
+
+	for (i = 0; i < w->numextents; i++) {
+		struct extent *ex = &w->extents[i];
+		struct entry *e = ext_entry(fw, ex);
+		unsigned len;
+		struct fd *fd;
+
+		if (fw->window && ex->len > 0) {
+			int ret = window_wait(fw, e, ex->len, 1);
+			if (ret < 0)
+				break;
+			if (ret == 0) {
+				adopt_fd(fw, w, e);
+				if (--e->numextents == 0 && e->fd)
+					close_fd(w, e->fd);
+				continue;
+			}
+		}
+		len = budget_read(fw, ex->len);
+		if (len == 0 && ex->len > 0)
+			break;
+		fd = get_fd(fw, w, e);
+		if (!fd) { 
+			entry_error(fw, e);
+			continue;
+		}
+		if (fw->populate) {
+			populate(fw, w, e, fd->fd, ex, len);
+		} else {
+			readahead(fd->fd, ex->offset, len);
+			stat_inc(ST_READAHEAD);
+			stat_add(ST_READAHEAD_BYTES, len);
+		}
+		stats_seek(&w->last_end, ex->disk, len);
+		if (len < ex->len)
+			break;
+		if (--e->numextents == 0)
+			close_fd(w, fd);
+	}
+	close_all_fds(w);
+	return NULL;
+}
+
+/* How many workers read a device in parallel. A disk gets one, to
+   read in strict disk order, a RAID array one per data disk. */
+static int device_parts(struct fastwalk *fw, dev_t dev)
+{
+	struct topology *t = dev_topology(fw, dev);
+	int n = 1;
+
+	if (t->type == TOPO_SSD)
+		n = get_depth(fw, dev);
+	else if (t->type == TOPO_RAID)
+		n = t->stripes;
+	return n < MAX_PARTS ? n : MAX_PARTS;
+}
+
+/* Split the extents of one device, which are in disk order, into 
+   parts lists read in parallel, each still in disk order. All extents
+   of a file go to the list of its first one, because the fd of a 
+   file belongs to one worker. On RAID that is the list for the disk
+   of the stripe, otherwise the files are dealt round robin. part has
+   the list of each entry, 0xff for none yet. bounds gets the start of
+   each list. */
+static void split_device(struct extent *exts, int num, int parts,
+			 struct topology *t, unsigned char *part, int *bounds)
+{
+	struct sortkey *keys = xmalloc(num * sizeof(struct sortkey));
+	int i, p, next = 0;
+
+	for (i = 0; i < num; i++) {
+		unsigned e = exts[i].entry;
+
+		if (part[e] == 0xff) {
+			if (t->type == TOPO_RAID && t->chunk)
+				part[e] = (exts[i].disk + t->offset) / 
+					t->chunk % parts;
+			else
+				part[e] = next++ % parts;
+		}
+		keys[i].key = part[e];
+		keys[i].index = i;
+	}
+	radix_sort(keys, num);
+	radix_permute(exts, num, sizeof(struct extent), keys);
+	for (i = 0, p = 0; p < parts; p++) {
+		bounds[p] = i;
+		while (i < num && keys[i].key == p)
+			i++;
+	}
+	bounds[parts] = num;
+	free(keys);
+}
+
+/* Split the sorted exts by device and run one worker per device,
+   so that a slow disk does not hold back the others. SSDs and RAID
+   arrays get several. The fd budget is shared between the workers. */
+static void do_readahead_pass(struct fastwalk *fw, struct extent *exts, int num)
+{
+	struct worker *workers;
+	unsigned char *part = NULL;
+	int bounds[MAX_PARTS + 1];
+	int i, k, start, fds, nworkers = 0, maxworkers = 0;
+
+	if (num == 0)
+		return;
+	if (fw->window)
+		window_start(fw, exts, num);
+	fds = fd_budget(fw) - fw->kept_fds;
+
+	for (start = 0, i = 1; i <= num; i++) {
+		if (i < num && 
+		    ext_entry(fw, &exts[i])->dev == ext_entry(fw, &exts[start])->dev)
+			continue;
+		maxworkers += device_parts(fw, fw->devs[ext_entry(fw, &exts[start])->dev]);
+		start = i;
+	}
+	workers = xmalloc(sizeof(struct worker) * maxworkers);
+
+	for (start = 0, i = 1; i <= num; i++) {
+		dev_t dev = fw->devs[ext_entry(fw, &exts[start])->dev];
+		int parts;
+
+		if (i < num && ext_entry(fw, &exts[i])->dev == 
+		    ext_entry(fw, &exts[start])->dev)
+			continue;
+		parts = device_parts(fw, dev);
+		/* Each worker needs a few fds for itself */
+		while (parts > 1 && fds / maxworkers < WORKER_FDS) {
+			parts--;
+			maxworkers--;
+		}
+		if (parts > 1) {
+			if (!part) {
+				part = xmalloc(fw->numentries);
+				memset(part, 0xff, fw->numentries);
+			}
+			split_device(exts + start, i - start, parts, 
+				     dev_topology(fw, dev), part, bounds);
+		} else {
+			bounds[0] = 0;
+			bounds[1] = i - start;
+		}
+		for (k = 0; k < parts; k++) {
+			if (bounds[k] == bounds[k + 1])
+				continue;
+			workers[nworkers].fw = fw;
+			workers[nworkers].extents = exts + start + bounds[k];
+			workers[nworkers].numextents = bounds[k+1] - bounds[k];
+			nworkers++;
+		}
+		start = i;
+	}
+	free(part);
+	for (i = 0; i < nworkers; i++)
+		init_fd(fw, &workers[i], fds / nworkers);
+
+	if (nworkers == 1) {
+		readahead_worker(&workers[0]);
+	} else {
+		for (i = 0; i < nworkers; i++) {
+			int err = pthread_create(&workers[i].thread, NULL, 
+						 readahead_worker, &workers[i]);
+			if (err) {
+				fprintf(stderr, "pthread_create: %s\n", strerror(err));
+				readahead_worker(&workers[i]);
+				workers[i].numextents = -1;
+			}
+		}
+		for (i = 0; i < nworkers; i++)
+			if (workers[i].numextents >= 0)
+				pthread_join(workers[i].thread, NULL);
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		exit_dirfds(&workers[i].dirs);
+		free(workers[i].fds);
+		free(workers[i].buf);
+	}
+	free(workers);
+}
+
+/* Content processing (-x): the files are read completely in disk
+   order and passed to the action. Uses the same per device queues
+   and -j depth as the metadata pass. */
+/* The part of path below the directory on the command line */
+static const char *root_relative(struct fastwalk *fw, struct entry *e,
+				 const char *path)
+{
+	int d = e->dir;
+
+	while (fw->dnames[d].parent >= 0)
+		d = fw->dnames[d].parent;
+	path += strlen(fw->names + fw->dnames[d].name);
+	while (*path == '/')
+		path++;
+	return path;
+}
+
+static void process_file(struct fastwalk *fw, struct dircache *c, struct entry *e, char *buf)
+{
+	char path[PATH_MAX];
+	struct action_file f;
+	struct stat st;
+	ssize_t n = 0;
+	int dfd;
+
+	f.path = entry_path(fw, e, path);
+	if (e->kept) {
+		f.fd = e->rawfd;
+		e->kept = 0;
+		__atomic_sub_fetch(&fw->kept_fds, 1, __ATOMIC_RELAXED);
+	} else {
+		dfd = dir_fd(fw, c, e->dir, 0);
+		f.fd = dfd < 0 ? -1 : openat(dfd, fw->names + e->name, O_RDONLY);
+		stat_inc(ST_OPEN);
+	}
+	stat_inc(ST_STAT);
+	if (!f.path || f.fd < 0 || fstat(f.fd, &st) < 0) {
+		entry_error(fw, e);
+		goto out;
+	}
+	posix_fadvise(f.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	f.name = root_relative(fw, e, f.path);
+	f.size = 0;
+	f.mode = st.st_mode;
+	f.arg = fw->action_parsed;
+	if (fw->action->open(&f) < 0) {
+		fw->error = 1;
+		goto out;
+	}
+	while ((n = read(f.fd, buf, ACTION_BUF)) != 0) {
+		stat_inc(ST_READ);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			Perror(fw, f.path);
+			break;
+		}
+		f.size += n;
+		stat_add(ST_READ_BYTES, n);
+		if (fw->action->data(&f, buf, n) < 0) {
+			fw->error = 1;
+			break;
+		}
+	}
+	if (fw->action->close(&f) < 0)
+		fw->error = 1;
+out:
+	if (f.fd >= 0) {
+		close(f.fd);
+		stat_inc(ST_CLOSE);
+	}
+}
+
+static void *process_worker(void *arg)
+{
+	struct metaq *q = arg;
+	struct fastwalk *fw = q->fw;
+	struct dircache c;
+	char *buf = xmalloc(ACTION_BUF);
+	int i;
+
+	init_dirfds(&c, q->dirfds);
+	while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < 
+	       q->numentries) {
+		if (q->entries[i].type == DT_REG && !q->entries[i].excluded)
+			process_file(fw, &c, &q->entries[i], buf);
+	}
+	exit_dirfds(&c);
+	free(buf);
+	return NULL;
+}
+
+/* Entries must be sorted by device and disk */
+static void do_process_pass(struct fastwalk *fw, struct entry *ents, int num)
+{
+	run_queues(fw, ents, num, fd_budget(fw) - fw->kept_fds, process_worker);
+}
+
+static void get_file(struct fastwalk *fw, struct entry *e, char *path,
+		     struct fastwalk_file *f)
+{
+	memset(f, 0, sizeof(struct fastwalk_file));
+	f->path = path;
+	f->dev = fw->devs[e->dev];
+	f->ino = e->ino;
+	if (fw->infos) {
+		struct info *in = &fw->infos[e - fw->entries];
+		f->size = in->size;
+		f->disk = in->disk;
+		f->numextents = in->numextents;
+	}
+}
+
+static int iterate_files(struct fastwalk *fw, int start)
+{
+	int i, ret;
+
+	for (i = start; i < fw->numentries; i++) {
+		struct entry *e = &fw->entries[i];
+		struct fastwalk_file f;
+		char buf[PATH_MAX];
+		char *path;
+
+		if (e->excluded)
+			continue;
+		path = entry_path(fw, e, buf);
+		if (!path) {
+			entry_error(fw, e);
+			continue;
+		}
+		get_file(fw, e, path, &f);
+		ret = fw->file_fn(&f, fw->arg);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int iterate_extents(struct fastwalk *fw, int ext)
+{
+	struct entry *last = NULL;
+	struct fastwalk_file f;
+	char buf[PATH_MAX];
+	int i, ret;
+
+	for (i = ext; i < fw->numextents; i++) {
+		struct extent *ex = &fw->extents[i];
+		struct entry *e = ext_entry(fw, ex);
+		struct fastwalk_extent x;
+
+		if (ex->len == 0)
+			continue;
+		if (e != last) {
+			char *path = entry_path(fw, e, buf);
+
+			if (!path) {
+				entry_error(fw, e);
+				continue;
+			}
+			get_file(fw, e, path, &f);
+			last = e;
+		}
+		x.disk = ex->disk;
+		x.offset = ex->offset;
+		x.len = ex->len;
+		ret = fw->extent_fn(&f, &x, fw->arg);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Hints (-H): the files in the order a previous run needed them,
+   like a list of -f. The first hint_group files form the first batch,
+   which is read in disk order, then the next and so on. The files
+   are identified by device and inode, so the names may be relative
+   to another directory. */
+
+struct hint_slot {
+	dev_t dev;
+	u64 ino;
+	unsigned order;		/* HINT_NONE for empty */
+};
+
+static struct hint_slot *hint_slot(struct fastwalk *fw, dev_t dev, u64 ino)
+{
+	unsigned i = ((u64)dev * 0x9e3779b97f4a7c15ULL ^ ino) & (fw->hint_size - 1);
+
+	while (fw->hint_hash[i].order != HINT_NONE &&
+	       (fw->hint_hash[i].dev != dev || fw->hint_hash[i].ino != ino))
+		i = (i + 1) & (fw->hint_size - 1);
+	return &fw->hint_hash[i];
+}
+
+static void grow_hints(struct fastwalk *fw)
+{
+	struct hint_slot *old = fw->hint_hash;
+	unsigned i, oldsize = fw->hint_size;
+
+	fw->hint_size = oldsize ? 2 * oldsize : 1024;
+	fw->hint_hash = xmalloc(fw->hint_size * sizeof(struct hint_slot));
+	for (i = 0; i < fw->hint_size; i++)
+		fw->hint_hash[i].order = HINT_NONE;
+	for (i = 0; i < oldsize; i++)
+		if (old[i].order != HINT_NONE)
+			*hint_slot(fw, old[i].dev, old[i].ino) = old[i];
+	free(old);
+}
+
+/* Once, the first time the hints are needed */
+static void load_hints(struct fastwalk *fw)
+{
+	FILE *f = fopen(fw->hint_list, "r");
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	unsigned n = 0;
+	struct stat st;
+
+	grow_hints(fw);
+	if (!f) {
+		Perror(fw, fw->hint_list);
+		return;
+	}
+	while ((len = getline(&line, &size, f)) > 0) {
+		struct hint_slot *h;
+
+		if (line[len - 1] == '\n')
+			line[len - 1] = 0;
+		stat_inc(ST_STAT);
+		if (stat(line, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (2 * (n + 1) > fw->hint_size)
+			grow_hints(fw);
+		/* The first time a file was needed counts */
+		h = hint_slot(fw, st.st_dev, st.st_ino);
+		if (h->order != HINT_NONE)
+			continue;
+		h->dev = st.st_dev;
+		h->ino = st.st_ino;
+		h->order = n++;
+	}
+	free(line);
+	fclose(f);
+}
+
+/* Apply -I, -z, -P and -H to the entries from start on. After the walk,
+   when the types of all entries are known. */
+static void classify(struct fastwalk *fw, int start)
+{
+	int sizes = fw->min_size > 0 || fw->max_size != ~0ULL;
+	int i, v;
+
+	if (fw->hint_list) {
+		if (!fw->hint_hash)
+			load_hints(fw);
+		fw->hints = xrealloc(fw->hints, fw->numentries * sizeof(unsigned));
+		for (i = start; i < fw->numentries; i++) {
+			struct entry *e = &fw->entries[i];
+			struct hint_slot *h = hint_slot(fw, fw->devs[e->dev], e->ino);
+
+			fw->hints[i] = h->order == HINT_NONE ? HINT_NONE :
+				h->order / fw->hint_group;
+		}
+	}
+
+	for (i = start; i < fw->numentries; i++) {
+		struct entry *e = &fw->entries[i];
+		char *name = fw->names + e->name;
+
+		if (fw->numincludes && match_name(&fw->include, name) < 0)
+			e->excluded = 1;
+		/* Only regular files have a size worth filtering by */
+		if (sizes && e->type != DT_REG)
+			e->excluded = 1;
+		v = match_name(&fw->prios, name);
+		e->prio = v >= 0 ? v : PRIO_DEFAULT;
+	}
+}
+
+/* Get the disk addresses of the entries from start on, which are 
+   sorted by inode, and sort them or their extents in disk order. */
+static void sort_disk(struct fastwalk *fw, int start)
+{
+	int ext = fw->numextents;
+
+	if (fw->filter || fw->min_size > 0 || fw->max_size != ~0ULL)
+		classify(fw, start);
+
+	/* Second pass: Get disk addresses: reads inodes and extents.
+	   The extent reading is not necessarily in disk order
+	   because the kernel doesn't give us this currently. 
+	   But it should work for the common case of the extents
+	   (or indirect blocks) being inlined into the inode. */
+	if (fw->cachefile) {
+		fw->stamps = xrealloc(fw->stamps, 
+				      fw->numentries * sizeof(struct stamp));
+		memset(fw->stamps + start, 0, 
+		       (fw->numentries - start) * sizeof(struct stamp));
+	}
+	if (fw->flags & FASTWALK_INFO) {
+		fw->infos = xrealloc(fw->infos, fw->numentries * sizeof(struct info));
+		memset(fw->infos + start, 0, 
+		       (fw->numentries - start) * sizeof(struct info));
+	}
+	stats_phase("metadata");
+	do_metadata_pass(fw, fw->entries + start, fw->numentries - start);
+	if (fw->cachefile) {
+		stats_phase("cache");
+		save_cache(fw);
+		cache_close(&fw->cache);
+	}
+
+	stats_phase("sort");
+	if (fw->do_readahead) {
+		drop_resident(fw, ext);
+		sort_extents(fw, ext);
+		coalesce_extents(fw, ext);
+	} else if (all_extents(fw)) {
+		sort_extents(fw, ext);
+	} else {
+		sort_entries_disk(fw, start, ext);
+	}
+	fw->sorted = 1;
+	fw->sorted_ext = ext;
+}
+
+/* Let the action refuse the trees, before it sees any file */
+static int check_action(struct fastwalk *fw)
+{
+	char **roots;
+	int i, n = 0, ret;
+
+	if (!fw->action->check)
+		return 0;
+	roots = xmalloc(fw->numdnames * sizeof(char *));
+	for (i = 0; i < fw->numdnames; i++)
+		if (fw->dnames[i].parent < 0)
+			roots[n++] = fw->names + fw->dnames[i].name;
+	ret = fw->action->check(fw->action_parsed, roots, n);
+	free(roots);
+	if (ret < 0)
+		fw->error = 1;
+	return ret;
+}
+
+/* Read ahead, process or pass to the callbacks the sorted entries 
+   from start on. Afterwards they are done. */
+static int output_disk(struct fastwalk *fw, int start)
+{
+	int ext = fw->sorted_ext, ret = 0;
+
+	if (fw->do_readahead) {
+		stats_phase("readahead");
+		do_readahead_pass(fw, fw->extents + ext, fw->numextents - ext);
+		close_kept(fw, start);
+	} else if (fw->action) {
+		stats_phase("process");
+		if (check_action(fw) == 0)
+			do_process_pass(fw, fw->entries + start, 
+					fw->numentries - start);
+		close_kept(fw, start);
+	} else if (fw->extent_fn) {
+		stats_phase("output");
+		ret = iterate_extents(fw, ext);
+	} else if (fw->file_fn) {
+		stats_phase("output");
+		ret = iterate_files(fw, start);
+	}
+	fw->sorted = 0;
+	fw->flushed = fw->numentries;
+	if (ret)
+		fw->stopped = ret;
+	return ret;
+}
+
+/* Streaming mode (-b): called after each directory. Once enough
+   new files were found, process them as a batch, so that the 
+   output starts before the walk is finished. The order is only
+   by disk within each batch. */
+static void flush_batch(struct fastwalk *fw)
+{
+	if (!fw->batch || fw->numentries - fw->flushed < fw->batch)
+		return;
+	stats_phase("unknown");
+	sort_inodes(fw, fw->flushed);
+	resolve_unknown(fw, fw->flushed);
+	sort_disk(fw, fw->flushed);
+	output_disk(fw, fw->flushed);
+	fflush(stdout);
+	stats_phase("walk");
+}
+
+/* Number with optional k, m or g suffix. Returns 0 or -1 */
+static int parse_size(const char *arg, u64 *n)
+{
+	char *end;
+
+	*n = strtoull(arg, &end, 0);
+	switch (*end) {
+	case 'g': case 'G':
+		*n <<= 10;
+		/* FALL THROUGH */
+	case 'm': case 'M':
+		*n <<= 10;
+		/* FALL THROUGH */
+	case 'k': case 'K':
+		*n <<= 10;
+		end++;
+	}
+	return end == arg || *end ? -1 : 0;
+}
+
+static u64 mem_available(void)
+{
+	FILE *f = fopen("/proc/meminfo", "r");
+	char line[100];
+	unsigned long long kb;
+	u64 n = 0;
+
+	while (f && fgets(line, sizeof line, f)) {
+		if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+			n = kb * 1024;
+			break;
+		}
+	}
+	if (f)
+		fclose(f);
+	if (!n)
+		n = (u64)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	return n;
+}
+
+/* Bytes, or N% of the currently available memory */
+static int parse_budget(const char *arg, u64 *n)
+{
+	size_t len = strlen(arg);
+	char *end;
+	double pct;
+
+	if (len == 0 || arg[len - 1] != '%')
+		return parse_size(arg, n);
+	pct = strtod(arg, &end);
+	if (end != arg + len - 1 || pct <= 0 || pct > 100)
+		return -1;
+	*n = mem_available() * (pct / 100);
+	return 0;
+}
+
+struct fastwalk *fastwalk_new(int flags)
+{
+	struct fastwalk *fw = xmalloc(sizeof(struct fastwalk));
+
+	memset(fw, 0, sizeof(struct fastwalk));
+	fw->flags = flags;
+	fw->merge_gap = MERGE_GAP;
+	fw->max_size = ~0ULL;
+	fw->hint_group = HINT_GROUP;
+	pthread_mutex_init(&fw->extents_lock, NULL);
+	pthread_mutex_init(&fw->window_lock, NULL);
+	pthread_cond_init(&fw->window_cond, NULL);
+	fw->skip = xmalloc(2 * sizeof(char *));
+	fw->skip[fw->numskip++] = xstrdup(".");
+	fw->skip[fw->numskip++] = xstrdup("..");
+	if (match_add_name(&fw->exclude, ".", 1) < 0 ||
+	    match_add_name(&fw->exclude, "..", 1) < 0)
+		oom();
+	return fw;
+}
+
+static void free_action(struct fastwalk *fw)
+{
+	if (fw->action && fw->action->free)
+		fw->action->free(fw->action_parsed);
+	fw->action = NULL;
+	fw->action_parsed = NULL;
+	free(fw->action_arg);
+	fw->action_arg = NULL;
+}
+
+void fastwalk_free(struct fastwalk *fw)
+{
+	int i;
+
+	/* Stop the consumer before the state it updates goes away */
+	if (fw->progress)
+		progress_stop(fw->progress);
+	close_kept(fw, fw->flushed);
+	cache_close(&fw->cache);
+	for (i = 0; i < fw->numskip; i++)
+		free(fw->skip[i]);
+	free(fw->skip);
+	match_free(&fw->exclude);
+	match_free(&fw->include);
+	match_free(&fw->prios);
+	free(fw->hint_list);
+	free(fw->hint_hash);
+	free(fw->hints);
+	free(fw->cachefile);
+	free(fw->progress_list);
+	free_action(fw);
+	free(fw->depths);
+	free(fw->entries);
+	free(fw->infos);
+	free(fw->extents);
+	free(fw->devs);
+	free(fw->topos);
+	free(fw->names);
+	free(fw->dnames);
+	free(fw->dirs);
+	free(fw->dentbuf);
+	free(fw->stamps);
+	free(fw->dstamps);
+	free(fw->issued);
+	free(fw->consumed);
+	free(fw->window_hash);
+	pthread_mutex_destroy(&fw->extents_lock);
+	pthread_mutex_destroy(&fw->window_lock);
+	pthread_cond_destroy(&fw->window_cond);
+	free(fw);
+}
+
+/* -p names are matched exactly, -e patterns as globs. Both change
+   the tree, so they go into the hash of the cache. */
+static void add_skip(struct fastwalk *fw, int opt, const char *arg)
+{
+	char *s = xmalloc(strlen(arg) + 3);
+	int ret;
+
+	if (opt == 'e') {
+		sprintf(s, "/e%s", arg);
+		ret = match_add(&fw->exclude, arg, 1);
+	} else {
+		strcpy(s, arg);
+		ret = match_add_name(&fw->exclude, arg, 1);
+	}
+	if (ret < 0)
+		oom();
+	fw->skip = xrealloc(fw->skip, (fw->numskip + 1) * sizeof(char *));
+	fw->skip[fw->numskip++] = s;
+}
+
+/* CLASS:PATTERN[,PATTERN...] */
+static int add_prio(struct fastwalk *fw, const char *arg)
+{
+	char *end, *p, *list, *save;
+	long prio = strtol(arg, &end, 10);
+
+	if (end == arg || *end != ':' || !end[1] || 
+	    prio < -PRIO_RANGE || prio > PRIO_RANGE) {
+		errno = EINVAL;
+		return -1;
+	}
+	list = xstrdup(end + 1);
+	for (p = strtok_r(list, ",", &save); p; p = strtok_r(NULL, ",", &save))
+		if (match_add(&fw->prios, p, PRIO_DEFAULT + prio) < 0)
+			oom();
+	free(list);
+	fw->filter = 1;
+	return 0;
+}
+
+/* [MIN][:MAX] */
+static int parse_sizes(const char *arg, u64 *min, u64 *max)
+{
+	char *s = xstrdup(arg), *colon = strchr(s, ':');
+	int ret = 0;
+
+	*min = 0;
+	*max = ~0ULL;
+	if (colon)
+		*colon++ = 0;
+	if ((*s && parse_size(s, min) < 0) ||
+	    (colon && *colon && parse_size(colon, max) < 0) ||
+	    *max < *min || (!*s && !(colon && *colon)))
+		ret = -1;
+	free(s);
+	return ret;
+}
+
+int fastwalk_option(struct fastwalk *fw, int opt, const char *arg)
+{
+	switch (opt) { 
+	case 'b':
+		fw->batch = atoi(arg);
+		if (fw->batch <= 0)
+			goto inval;
+		break;
+	case 'c':
+		free(fw->cachefile);
+		fw->cachefile = xstrdup(arg);
+		break;
+	case 'D':
+		fw->dir_order = 1;
+		break;
+	case 'd':
+		fw->debug++;
+		break;
+	case 'f':
+		free(fw->progress_list);
+		fw->progress_list = xstrdup(arg);
+		break;
+	case 'g':
+		if (parse_size(arg, &fw->merge_gap) < 0)
+			goto inval;
+		break;
+	case 'i':
+		fw->incremental = 1;
+		break;
+	case 'j':
+		return set_depth(fw, arg);
+	case 'n':
+		fw->max_fds = atoi(arg);
+		if (fw->max_fds < MIN_FDS)
+			goto inval;
+		break;
+	case 'm':
+		if (parse_budget(arg, &fw->max_bytes) < 0 || fw->max_bytes == 0)
+			goto inval;
+		break;
+	case 'e':
+	case 'p':
+		add_skip(fw, opt, arg);
+		break;
+	case 'G':
+		fw->hint_group = atoi(arg);
+		if (fw->hint_group <= 0)
+			goto inval;
+		break;
+	case 'H':
+		free(fw->hint_list);
+		fw->hint_list = xstrdup(arg);
+		fw->filter = 1;
+		break;
+	case 'I':
+		if (match_add(&fw->include, arg, 1) < 0)
+			oom();
+		fw->numincludes++;
+		fw->filter = 1;
+		break;
+	case 'P':
+		return add_prio(fw, arg);
+	case 'R':
+		fw->populate = 1;
+		/* FALL THROUGH */
+	case 'r':
+		fw->do_readahead = 1;
+		break;
+	case 'z':
+		if (parse_sizes(arg, &fw->min_size, &fw->max_size) < 0)
+			goto inval;
+		break;
+	case 'u':
+		fw->use_uring = 1;
+		break;
+	case 'w':
+		if (parse_size(arg, &fw->window) < 0 || fw->window == 0)
+			goto inval;
+		break;
+	case 'x':
+		/* The action keeps pointers into its argument */
+		free_action(fw);
+		fw->action_arg = xstrdup(arg);
+		fw->action = action_find(fw->action_arg, &fw->action_parsed);
+		if (!fw->action)
+			goto inval;
+		break;
+	default:
+		goto inval;
+	}
+	return 0;
+
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+void fastwalk_callbacks(struct fastwalk *fw, fastwalk_file_fn file_fn,
+			fastwalk_extent_fn extent_fn, void *arg)
+{
+	fw->file_fn = file_fn;
+	fw->extent_fn = extent_fn;
+	fw->arg = arg;
+}
+
+void fastwalk_dir_callback(struct fastwalk *fw, fastwalk_dir_fn dir_fn, 
+			   void *arg)
+{
+	fw->dir_fn = dir_fn;
+	fw->dir_arg = arg;
+}
+
+int fastwalk_add(struct fastwalk *fw, const char *dir)
+{
+	queue_dir(fw, add_dname(fw, -1, add_name(fw, dir), 0), 0);
+	return 0;
+}
+
+static int result(struct fastwalk *fw)
+{
+	if (fw->stopped)
+		return fw->stopped;
+	return fw->error ? -1 : 0;
+}
+
+/* The combinations fastwalk(1) rejects */
+static int bad_options(struct fastwalk *fw)
+{
+	return (fw->incremental && !fw->cachefile) || 
+	       (fw->batch && fw->cachefile) ||
+	       (fw->window && !fw->do_readahead) || 
+	       (fw->progress_list && !fw->window) ||
+	       (fw->action && fw->do_readahead);
+}
+
+int fastwalk_walk(struct fastwalk *fw)
+{
+	int found_unknown;
+
+	if (bad_options(fw)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (fw->stopped || fw->numdirs == 0)
+		return result(fw);
+	if (fw->cachefile && !fw->cache.hdr)
+		load_cache(fw);
+	fw->skiphash = hash_skip(fw->skip, fw->numskip);
+	init_dirfds(&fw->walk_dirs, dirfd_share(fd_budget(fw)));
+
+	/* First pass: read directories */
+	stats_phase("walk");
+	found_unknown = walk(fw);
+
+	/* Inode sort for fast stat */
+	stats_phase("sort");
+	sort_inodes(fw, fw->flushed);
+	
+	/* For DT_UNKNOWN file systems complete the tree */
+	if (found_unknown && !fw->stopped) {
+		stats_phase("unknown");
+		handle_unknown(fw);
+	}
+	exit_dirfds(&fw->walk_dirs);
+	return result(fw);
+}
+
+int fastwalk_sort(struct fastwalk *fw)
+{
+	if (!fw->sorted && !fw->stopped)
+		sort_disk(fw, fw->flushed);
+	return result(fw);
+}
+
+int fastwalk_iterate(struct fastwalk *fw)
+{
+	fastwalk_sort(fw);
+	if (!fw->stopped)
+		output_disk(fw, fw->flushed);
+	return result(fw);
+}
+
+void fastwalk_rewind(struct fastwalk *fw)
+{
+	int i;
+
+	if (fw->progress) {
+		progress_stop(fw->progress);
+		fw->progress = NULL;
+	}
+	fw->consumer_done = 0;
+	fw->outstanding = 0;
+	if (fw->consumed) {
+		memset(fw->consumed, 0, fw->maxconsumed);
+		memset(fw->issued, 0, fw->maxconsumed * sizeof(u64));
+	}
+	fw->read_bytes = 0;
+	fw->populated = 0;
+	/* The readahead counted them down to close the files */
+	for (i = 0; i < fw->numentries; i++)
+		fw->entries[i].numextents = 0;
+	for (i = 0; i < fw->numextents; i++)
+		ext_entry(fw, &fw->extents[i])->numextents++;
+	fw->stopped = 0;
+	fw->error = 0;
+	fw->flushed = 0;
+	fw->sorted_ext = 0;
+	fw->sorted = 1;
+}
+
+unsigned long long fastwalk_populated(struct fastwalk *fw)
+{
+	return fw->populated;
+}
@@ -0,0 +1,159 @@
+/* Copyright (c) 2010-2013 by Intel Corp.
+
+   fastwalk is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; version
+   2.
+
+   fastwalk is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should find a copy of v2 of the GNU General Public License somewhere
+   on your Linux system. */
+
+/* Name matching for the walk, which checks every directory entry.
+   A set of plain names costs one hash lookup per name and all *.ext
+   patterns a second one for the extension, independent of how many
+   there are. Only real globs are matched one after the other. */
+#define _GNU_SOURCE 1
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include "match.h"
+
+static unsigned long long hash_name(const char *s)
+{
+	unsigned long long h = 14695981039346656037ULL;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+	return h;
+}
+
+static struct match_slot *lookup(struct match_table *t, const char *key,
+				 unsigned long long h)
+{
+	unsigned i;
+
+	for (i = h & (t->size - 1); t->slots[i].key; i = (i + 1) & (t->size - 1))
+		if (t->slots[i].hash == h && !strcmp(t->slots[i].key, key))
+			break;
+	return &t->slots[i];
+}
+
+static int table_add(struct match_table *t, const char *key, int value)
+{
+	unsigned long long h = hash_name(key);
+	struct match_slot *s;
+
+	/* Keep it at most half full */
+	if (2 * (t->num + 1) > t->size) {
+		struct match_table n;
+		unsigned i;
+
+		n.size = t->size ? 2 * t->size : 16;
+		n.num = t->num;
+		n.slots = calloc(n.size, sizeof(struct match_slot));
+		if (!n.slots)
+			return -1;
+		for (i = 0; i < t->size; i++)
+			if (t->slots[i].key)
+				*lookup(&n, t->slots[i].key, t->slots[i].hash) = 
+					t->slots[i];
+		free(t->slots);
+		*t = n;
+	}
+	s = lookup(t, key, h);
+	/* The first pattern given wins */
+	if (s->key)
+		return 0;
+	s->key = strdup(key);
+	if (!s->key)
+		return -1;
+	s->hash = h;
+	s->value = value;
+	t->num++;
+	return 0;
+}
+
+static int table_get(struct match_table *t, const char *key)
+{
+	struct match_slot *s;
+
+	if (!t->num)
+		return -1;
+	s = lookup(t, key, hash_name(key));
+	return s->key ? s->value : -1;
+}
+
+static void table_free(struct match_table *t)
+{
+	unsigned i;
+
+	for (i = 0; i < t->size; i++)
+		free(t->slots[i].key);
+	free(t->slots);
+	memset(t, 0, sizeof(struct match_table));
+}
+
+/* Add a pattern matching to value, which must not be negative.
+   Returns 0 or -1 when out of memory. */
+int match_add(struct match *m, const char *pattern, int value)
+{
+	struct match_glob *g;
+
+	if (!strpbrk(pattern, "*?[\\"))
+		return table_add(&m->names, pattern, value);
+	if (pattern[0] == '*' && pattern[1] == '.' && pattern[2] &&
+	    !strpbrk(pattern + 2, "*?[\\."))
+		return table_add(&m->exts, pattern + 2, value);
+	g = realloc(m->globs, (m->numglobs + 1) * sizeof(struct match_glob));
+	if (!g)
+		return -1;
+	m->globs = g;
+	g[m->numglobs].pattern = strdup(pattern);
+	if (!g[m->numglobs].pattern)
+		return -1;
+	g[m->numglobs++].value = value;
+	return 0;
+}
+
+/* Only matches name itself, even when it looks like a pattern */
+int match_add_name(struct match *m, const char *name, int value)
+{
+	return table_add(&m->names, name, value);
+}
+
+/* Returns the value of the matching pattern, or -1. Plain names
+   are checked first, then extensions, then the other patterns in
+   the order they were added. */
+int match_name(struct match *m, const char *name)
+{
+	const char *ext;
+	int i, v;
+
+	v = table_get(&m->names, name);
+	if (v >= 0)
+		return v;
+	ext = strrchr(name, '.');
+	if (ext && (v = table_get(&m->exts, ext + 1)) >= 0)
+		return v;
+	for (i = 0; i < m->numglobs; i++)
+		if (!fnmatch(m->globs[i].pattern, name, 0))
+			return m->globs[i].value;
+	return -1;
+}
+
+void match_free(struct match *m)
+{
+	int i;
+
+	table_free(&m->names);
+	table_free(&m->exts);
+	for (i = 0; i < m->numglobs; i++)
+		free(m->globs[i].pattern);
+	free(m->globs);
+	memset(m, 0, sizeof(struct match));
+}
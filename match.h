@@ -0,0 +1,35 @@
+/* Match leaf names against a set of shell patterns. */
+#ifndef MATCH_H
+#define MATCH_H 1
+
+struct match_slot {
+	unsigned long long hash;
+	char *key;		/* NULL when empty */
+	int value;
+};
+
+struct match_table {
+	struct match_slot *slots;
+	unsigned size, num;	/* size is a power of two */
+};
+
+struct match_glob {
+	char *pattern;
+	int value;
+};
+
+/* Plain names and *.ext patterns are hashed, only the other
+   patterns are tried one by one with fnmatch */
+struct match {
+	struct match_table names;
+	struct match_table exts;
+	struct match_glob *globs;
+	int numglobs;
+};
+
+int match_add(struct match *m, const char *pattern, int value);
+int match_add_name(struct match *m, const char *name, int value);
+int match_name(struct match *m, const char *name);
+void match_free(struct match *m);
+
+#endif
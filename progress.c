@@ -0,0 +1,172 @@
+/* Copyright (c) 2010-2013 by Intel Corp.
+
+   fastwalk is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; version
+   2.
+
+   fastwalk is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should find a copy of v2 of the GNU General Public License somewhere
+   on your Linux system. */
+
+/* The consumer is either a list of file names it read, one per line,
+   from a file or pipe (for example from the build), or fanotify
+   FAN_ACCESS events on the mounts of the walked trees, which needs
+   CAP_SYS_ADMIN. A thread reads them and reports the files. */
+#define _GNU_SOURCE 1
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include "progress.h"
+
+enum {
+	EVENT_BUF = 64 * 1024,
+};
+
+struct progress {
+	pthread_t thread;
+	progress_fn fn;
+	void *arg;
+	FILE *list_file;
+	int fan_fd;
+};
+
+/* No cancellation while the callback holds its locks */
+static void report(struct progress *p, dev_t dev, ino_t ino, int done)
+{
+	int old;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+	p->fn(p->arg, dev, ino, done);
+	pthread_setcancelstate(old, NULL);
+}
+
+static void free_line(void *arg)
+{
+	free(*(char **)arg);
+}
+
+static void *list_thread(void *arg)
+{
+	struct progress *p = arg;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	struct stat st;
+
+	pthread_cleanup_push(free_line, &line);
+	while ((len = getline(&line, &size, p->list_file)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = 0;
+		if (stat(line, &st) == 0 && S_ISREG(st.st_mode))
+			report(p, st.st_dev, st.st_ino, 0);
+	}
+	report(p, 0, 0, 1);
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+static void *fanotify_thread(void *arg)
+{
+	struct progress *p = arg;
+	char *buf = malloc(EVENT_BUF);
+	pid_t self = getpid();
+	ssize_t len;
+
+	if (!buf)
+		goto out;
+	pthread_cleanup_push(free, buf);
+	while ((len = read(p->fan_fd, buf, EVENT_BUF)) > 0 || 
+	       (len < 0 && errno == EINTR)) {
+		struct fanotify_event_metadata *ev;
+
+		ev = (struct fanotify_event_metadata *)buf;
+		for (; FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len)) {
+			struct stat st;
+
+			if (ev->fd < 0)
+				continue;
+			if (ev->pid != self && fstat(ev->fd, &st) == 0)
+				report(p, st.st_dev, st.st_ino, 0);
+			close(ev->fd);
+		}
+	}
+	pthread_cleanup_pop(1);
+out:
+	report(p, 0, 0, 1);
+	return NULL;
+}
+
+static void progress_close(struct progress *p)
+{
+	if (p->list_file && p->list_file != stdin)
+		fclose(p->list_file);
+	if (p->fan_fd >= 0)
+		close(p->fan_fd);
+	free(p);
+}
+
+/* list is a file name, "-" for stdin, or NULL for fanotify on roots.
+   Returns NULL with errno set on failure. */
+struct progress *progress_start(const char *list, char **roots, int numroots, 
+				progress_fn fn, void *arg)
+{
+	struct progress *p = calloc(1, sizeof(struct progress));
+	void *(*func)(void *);
+	int i, err;
+
+	if (!p)
+		return NULL;
+	p->fn = fn;
+	p->arg = arg;
+	p->fan_fd = -1;
+	if (list) {
+		p->list_file = strcmp(list, "-") ? fopen(list, "r") : stdin;
+		if (!p->list_file)
+			goto err;
+		func = list_thread;
+	} else {
+		p->fan_fd = fanotify_init(FAN_CLASS_NOTIF|FAN_CLOEXEC, 
+					  O_RDONLY|O_LARGEFILE);
+		if (p->fan_fd < 0)
+			goto err;
+		for (i = 0; i < numroots; i++) {
+			if (fanotify_mark(p->fan_fd, FAN_MARK_ADD|FAN_MARK_MOUNT,
+					  FAN_ACCESS, AT_FDCWD, roots[i]) < 0)
+				goto err;
+		}
+		func = fanotify_thread;
+	}
+	err = pthread_create(&p->thread, NULL, func, p);
+	if (err) {
+		errno = err;
+		goto err;
+	}
+	return p;
+
+err:
+	err = errno;
+	progress_close(p);
+	errno = err;
+	return NULL;
+}
+
+/* Stop the thread, the callback is not called anymore afterwards */
+void progress_stop(struct progress *p)
+{
+	if (!p)
+		return;
+	pthread_cancel(p->thread);
+	pthread_join(p->thread, NULL);
+	progress_close(p);
+}
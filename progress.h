@@ -0,0 +1,17 @@
+/* Follow the progress of another program reading files. */
+#ifndef PROGRESS_H
+#define PROGRESS_H 1
+
+#include <sys/types.h>
+
+struct progress;
+
+/* Called from the progress thread for each file the consumer read.
+   done is set once when the consumer is finished. */
+typedef void (*progress_fn)(void *arg, dev_t dev, ino_t ino, int done);
+
+struct progress *progress_start(const char *list, char **roots, int numroots, 
+				progress_fn fn, void *arg);
+void progress_stop(struct progress *p);
+
+#endif
@@ -0,0 +1,181 @@
+/* Copyright (c) 2010-2013 by Intel Corp.
+
+   fastwalk is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; version
+   2.
+
+   fastwalk is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should find a copy of v2 of the GNU General Public License somewhere
+   on your Linux system. */
+
+/* LSD radix sort on (key, index) pairs. The sort is stable, so sorting
+   by a minor key first and then by a major key gives the combined
+   order. Byte positions where all keys are the same are skipped, which
+   makes small keys (like device indexes) cheap. Big inputs are 
+   histogrammed and scattered by several threads. */
+#define _GNU_SOURCE 1
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "sort.h"
+
+enum {
+	RADIX_BITS = 8,
+	RADIX = 1 << RADIX_BITS,
+	PARALLEL_MIN = 1 << 20,	/* below this threads don't pay off */
+	MAX_THREADS = 16,
+};
+
+struct radix_job {
+	pthread_t thread;
+	struct sortkey *src, *dst;
+	size_t start, end;
+	int shift;
+	int scatter;
+	size_t count[RADIX];
+};
+
+static void *xmalloc(size_t n)
+{
+	void *p = malloc(n);
+	if (!p) {
+		fprintf(stderr, "Out of memory\n");
+		exit(ENOMEM);
+	}
+	return p;
+}
+
+static void histogram(struct radix_job *j)
+{
+	size_t i;
+	memset(j->count, 0, sizeof(j->count));
+	for (i = j->start; i < j->end; i++)
+		j->count[(j->src[i].key >> j->shift) & (RADIX - 1)]++;
+}
+
+/* count holds the start offsets of each bucket for this job */
+static void scatter(struct radix_job *j)
+{
+	size_t i;
+	for (i = j->start; i < j->end; i++) {
+		unsigned b = (j->src[i].key >> j->shift) & (RADIX - 1);
+		j->dst[j->count[b]++] = j->src[i];
+	}
+}
+
+static void *radix_thread(void *arg)
+{
+	struct radix_job *j = arg;
+	if (j->scatter)
+		scatter(j);
+	else
+		histogram(j);
+	return NULL;
+}
+
+static void run_jobs(struct radix_job *jobs, int njobs)
+{
+	int started[MAX_THREADS];
+	int i;
+
+	for (i = 1; i < njobs; i++) {
+		started[i] = !pthread_create(&jobs[i].thread, NULL, 
+					     radix_thread, &jobs[i]);
+		if (!started[i])
+			radix_thread(&jobs[i]);
+	}
+	radix_thread(&jobs[0]);
+	for (i = 1; i < njobs; i++)
+		if (started[i])
+			pthread_join(jobs[i].thread, NULL);
+}
+
+static int num_threads(size_t n)
+{
+	long cpus;
+	if (n < PARALLEL_MIN)
+		return 1;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > MAX_THREADS)
+		cpus = MAX_THREADS;
+	return cpus;
+}
+
+void radix_sort(struct sortkey *keys, size_t n)
+{
+	struct sortkey *src = keys, *dst, *tmp;
+	struct radix_job jobs[MAX_THREADS];
+	int njobs = num_threads(n);
+	int shift, i, b;
+	size_t off;
+
+	if (n < 2)
+		return;
+	tmp = dst = xmalloc(n * sizeof(struct sortkey));
+
+	for (i = 0; i < njobs; i++) {
+		jobs[i].start = n * i / njobs;
+		jobs[i].end = n * (i + 1) / njobs;
+	}
+
+	for (shift = 0; shift < 64; shift += RADIX_BITS) {
+		for (i = 0; i < njobs; i++) {
+			jobs[i].src = src;
+			jobs[i].dst = dst;
+			jobs[i].shift = shift;
+			jobs[i].scatter = 0;
+		}
+		run_jobs(jobs, njobs);
+
+		/* Turn the counts into start offsets, bucket major */
+		off = 0;
+		for (b = 0; b < RADIX; b++) {
+			size_t total = 0;
+			for (i = 0; i < njobs; i++)
+				total += jobs[i].count[b];
+			if (total == n)
+				break;
+			for (i = 0; i < njobs; i++) {
+				size_t c = jobs[i].count[b];
+				jobs[i].count[b] = off;
+				off += c;
+			}
+		}
+		/* All keys have the same digit: nothing to do */
+		if (b < RADIX)
+			continue;
+
+		for (i = 0; i < njobs; i++)
+			jobs[i].scatter = 1;
+		run_jobs(jobs, njobs);
+
+		dst = src;
+		src = jobs[0].dst;
+	}
+
+	if (src != keys)
+		memcpy(keys, src, n * sizeof(struct sortkey));
+	free(tmp);
+}
+
+/* Reorder the n elements of size size at base into the order of keys */
+void radix_permute(void *base, size_t n, size_t size, struct sortkey *keys)
+{
+	char *tmp = xmalloc(n * size);
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		memcpy(tmp + i * size, (char *)base + keys[i].index * size, size);
+	memcpy(base, tmp, n * size);
+	free(tmp);
+}
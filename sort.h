@@ -0,0 +1,15 @@
+/* LSD radix sort of 64bit keys with an index, for reordering arrays. */
+#ifndef SORT_H
+#define SORT_H 1
+
+#include <stddef.h>
+
+struct sortkey {
+	unsigned long long key;
+	unsigned index;
+};
+
+void radix_sort(struct sortkey *keys, size_t n);
+void radix_permute(void *base, size_t n, size_t size, struct sortkey *keys);
+
+#endif
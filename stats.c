@@ -0,0 +1,211 @@
+/* Copyright (c) 2010-2013 by Intel Corp.
+
+   fastwalk is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; version
+   2.
+
+   fastwalk is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should find a copy of v2 of the GNU General Public License somewhere
+   on your Linux system. */
+
+/* Statistics for tuning: counters updated by all threads, the wall
+   and CPU time of each phase, and a histogram of the distances 
+   between consecutive reads on disk. */
+#define _GNU_SOURCE 1
+#include <sys/resource.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+int stats_on;
+unsigned long long stats[NUM_STATS];
+
+static const char *stat_names[NUM_STATS] = {
+	[ST_GETDENTS] = "getdents",
+	[ST_OPEN] = "open",
+	[ST_STAT] = "stat",
+	[ST_FIEMAP] = "fiemap",
+	[ST_RESIDENT] = "cachestat",
+	[ST_READAHEAD] = "readahead",
+	[ST_READ] = "read",
+	[ST_CLOSE] = "close",
+	[ST_URING_ENTER] = "io_uring_enter",
+	[ST_READAHEAD_BYTES] = "readahead_bytes",
+	[ST_READ_BYTES] = "read_bytes",
+	[ST_POPULATED_BYTES] = "populated_bytes",
+	[ST_EXTENTS_MERGED] = "extents_merged",
+	[ST_EXTENTS_COALESCED] = "extents_coalesced",
+	[ST_FILES_RESIDENT] = "files_resident",
+	[ST_FD_HIT] = "fd_hit",
+	[ST_FD_MISS] = "fd_miss",
+	[ST_FD_EVICT] = "fd_evict",
+	[ST_DIRFD_HIT] = "dirfd_hit",
+	[ST_DIRFD_MISS] = "dirfd_miss",
+	[ST_DIRFD_EVICT] = "dirfd_evict",
+};
+
+enum { MAX_PHASES = 16, SEEK_BUCKETS = 65 };
+
+struct phase {
+	const char *name;
+	double wall, cpu;
+};
+
+static struct phase phases[MAX_PHASES];
+static int numphases;
+static struct phase *cur;
+static double cur_wall, cur_cpu;
+
+/* Bucket 0 is no seek, bucket n a distance below 2^n bytes */
+static unsigned long long seeks[SEEK_BUCKETS];
+static unsigned long long backward;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Of all threads */
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* End the current phase and start name, NULL for none. A phase that
+   runs several times, like in streaming mode, is summed up. */
+void stats_phase(const char *name)
+{
+	double wall, cpu;
+	int i;
+
+	if (!stats_on)
+		return;
+	wall = now();
+	cpu = cpu_time();
+	if (cur) {
+		cur->wall += wall - cur_wall;
+		cur->cpu += cpu - cur_cpu;
+		cur = NULL;
+	}
+	if (!name)
+		return;
+	for (i = 0; i < numphases; i++)
+		if (!strcmp(phases[i].name, name))
+			break;
+	if (i == numphases) {
+		if (numphases == MAX_PHASES)
+			return;
+		phases[numphases++].name = name;
+	}
+	cur = &phases[i];
+	cur_wall = wall;
+	cur_cpu = cpu;
+}
+
+/* A read of len bytes at disk, after one that ended at *last.
+   Each caller keeps last for its device. */
+void stats_seek(unsigned long long *last, unsigned long long disk,
+		unsigned long long len)
+{
+	unsigned long long d;
+	int b;
+
+	if (!stats_on)
+		return;
+	if (*last) {
+		d = disk >= *last ? disk - *last : *last - disk;
+		b = d ? 64 - __builtin_clzll(d) : 0;
+		__atomic_add_fetch(&seeks[b], 1, __ATOMIC_RELAXED);
+		if (disk < *last)
+			__atomic_add_fetch(&backward, 1, __ATOMIC_RELAXED);
+	}
+	*last = disk + len;
+}
+
+static void size_name(char *buf, int bucket)
+{
+	static const char units[] = "KMGTPE";
+	int shift = bucket;
+
+	if (bucket == 0) {
+		strcpy(buf, "0");
+		return;
+	}
+	if (shift < 10) {
+		sprintf(buf, "<%d", 1 << shift);
+		return;
+	}
+	sprintf(buf, "<%d%c", 1 << (shift % 10), units[shift / 10 - 1]);
+}
+
+static void print_text(void)
+{
+	char buf[16];
+	int i;
+
+	fprintf(stderr, "%-12s %10s %10s\n", "phase", "wall", "cpu");
+	for (i = 0; i < numphases; i++)
+		fprintf(stderr, "%-12s %10.3f %10.3f\n", phases[i].name,
+			phases[i].wall, phases[i].cpu);
+	fputc('\n', stderr);
+	for (i = 0; i < NUM_STATS; i++)
+		fprintf(stderr, "%-18s %llu\n", stat_names[i], stats[i]);
+	fprintf(stderr, "\nseek distance\n");
+	for (i = 0; i < SEEK_BUCKETS; i++) {
+		if (!seeks[i])
+			continue;
+		size_name(buf, i);
+		fprintf(stderr, "%-10s %llu\n", buf, seeks[i]);
+	}
+	fprintf(stderr, "%-10s %llu\n", "backward", backward);
+}
+
+static void print_json(void)
+{
+	const char *sep = "";
+	int i;
+
+	fprintf(stderr, "{\"phases\": {");
+	for (i = 0; i < numphases; i++)
+		fprintf(stderr, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}", 
+			i ? ", " : "", phases[i].name, 
+			phases[i].wall, phases[i].cpu);
+	fprintf(stderr, "}, \"counters\": {");
+	for (i = 0; i < NUM_STATS; i++)
+		fprintf(stderr, "%s\"%s\": %llu", i ? ", " : "", 
+			stat_names[i], stats[i]);
+	/* Keyed by the upper bound of the bucket */
+	fprintf(stderr, "}, \"seeks\": {");
+	for (i = 0; i < SEEK_BUCKETS; i++) {
+		if (!seeks[i])
+			continue;
+		fprintf(stderr, "%s\"%llu\": %llu", sep, 
+			i ? (i < 64 ? 1ULL << i : ~0ULL) : 0ULL, seeks[i]);
+		sep = ", ";
+	}
+	fprintf(stderr, "}, \"backward_seeks\": %llu}\n", backward);
+}
+
+void stats_print(int json)
+{
+	if (!stats_on)
+		return;
+	stats_phase(NULL);
+	if (json)
+		print_json();
+	else
+		print_text();
+}
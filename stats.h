@@ -0,0 +1,46 @@
+/* Counters and phase times for the -s report. */
+#ifndef STATS_H
+#define STATS_H 1
+
+enum stat_counter {
+	ST_GETDENTS,
+	ST_OPEN,
+	ST_STAT,
+	ST_FIEMAP,
+	ST_RESIDENT,		/* cachestat or mincore calls */
+	ST_READAHEAD,
+	ST_READ,
+	ST_CLOSE,
+	ST_URING_ENTER,
+	ST_READAHEAD_BYTES,
+	ST_READ_BYTES,
+	ST_POPULATED_BYTES,	/* resident after the reads of -R */
+	ST_EXTENTS_MERGED,	/* by merge_extents */
+	ST_EXTENTS_COALESCED,	/* into a read run */
+	ST_FILES_RESIDENT,
+	ST_FD_HIT,
+	ST_FD_MISS,
+	ST_FD_EVICT,
+	ST_DIRFD_HIT,
+	ST_DIRFD_MISS,
+	ST_DIRFD_EVICT,
+	NUM_STATS
+};
+
+extern int stats_on;
+extern unsigned long long stats[NUM_STATS];
+
+static inline void stat_add(enum stat_counter c, unsigned long long n)
+{
+	if (stats_on)
+		__atomic_add_fetch(&stats[c], n, __ATOMIC_RELAXED);
+}
+
+#define stat_inc(c) stat_add(c, 1)
+
+void stats_phase(const char *name);
+void stats_seek(unsigned long long *last, unsigned long long disk, 
+		unsigned long long len);
+void stats_print(int json);
+
+#endif
@@ -0,0 +1,114 @@
+/* Copyright (c) 2010-2013 by Intel Corp.
+
+   fastwalk is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; version
+   2.
+
+   fastwalk is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should find a copy of v2 of the GNU General Public License somewhere
+   on your Linux system. */
+
+/* Find the kind of block device under a file system in 
+   /sys/dev/block. A partition has no queue or md directory of its
+   own, those are in the parent. dm devices (LVM) report rotational
+   from their members, but their mapping is not in sysfs, so they are
+   treated like a single disk. */
+#define _GNU_SOURCE 1
+#include <sys/sysmacros.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "topology.h"
+
+/* Returns 0 and the first line of dir/name, or -1 */
+static int read_attr(const char *dir, const char *name, char *buf, int len)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int ret = -1;
+
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fgets(buf, len, f)) {
+		buf[strcspn(buf, "\n")] = 0;
+		ret = 0;
+	}
+	fclose(f);
+	return ret;
+}
+
+static int read_num(const char *dir, const char *name, 
+		    unsigned long long *n)
+{
+	char buf[64];
+
+	if (read_attr(dir, name, buf, sizeof buf) < 0)
+		return -1;
+	return sscanf(buf, "%llu", n) == 1 ? 0 : -1;
+}
+
+/* Data disks of an md array, 0 when it does not stripe */
+static unsigned md_stripes(const char *dir, unsigned long long *chunk)
+{
+	unsigned long long disks;
+	char level[32];
+
+	if (read_attr(dir, "md/level", level, sizeof level) < 0 ||
+	    read_num(dir, "md/raid_disks", &disks) < 0)
+		return 0;
+	if (read_num(dir, "md/chunk_size", chunk) < 0 || *chunk == 0)
+		*chunk = 0;
+	if (!strcmp(level, "raid1")) {
+		/* Every disk has everything, any split works */
+		*chunk = 0;
+		return disks;
+	}
+	if (*chunk == 0)
+		return 0;
+	if (!strcmp(level, "raid0"))
+		return disks;
+	if (!strcmp(level, "raid10"))
+		return disks / 2;	/* assumes the default near=2 */
+	if (!strcmp(level, "raid4") || !strcmp(level, "raid5"))
+		return disks - 1;
+	if (!strcmp(level, "raid6"))
+		return disks - 2;
+	return 0;
+}
+
+void get_topology(dev_t dev, struct topology *t)
+{
+	char dir[64], top[80];
+	unsigned long long n;
+
+	memset(t, 0, sizeof(struct topology));
+	t->type = TOPO_HDD;
+	snprintf(dir, sizeof dir, "/sys/dev/block/%u:%u", 
+		 major(dev), minor(dev));
+	if (access(dir, F_OK) < 0)
+		return;		/* no block device, like btrfs or NFS */
+	strcpy(top, dir);
+	if (read_num(dir, "partition", &n) == 0) {
+		snprintf(top, sizeof top, "%s/..", dir);
+		if (read_num(dir, "start", &n) == 0)
+			t->offset = n * 512;
+	}
+
+	t->stripes = md_stripes(top, &t->chunk);
+	if (t->stripes > 1) {
+		t->type = TOPO_RAID;
+		return;
+	}
+	t->stripes = 0;
+	t->chunk = 0;
+	if (read_num(top, "queue/rotational", &n) == 0 && n == 0)
+		t->type = TOPO_SSD;
+}
@@ -0,0 +1,22 @@
+/* What kind of storage a device is, from sysfs. */
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H 1
+
+#include <sys/types.h>
+
+enum {
+	TOPO_HDD,		/* also when unknown */
+	TOPO_SSD,
+	TOPO_RAID,		/* md striping over several disks */
+};
+
+struct topology {
+	int type;
+	unsigned stripes;	/* data disks, with TOPO_RAID */
+	unsigned long long chunk;	/* bytes per disk and stripe */
+	unsigned long long offset;	/* partition start in the array */
+};
+
+void get_topology(dev_t dev, struct topology *t);
+
+#endif
@@ -0,0 +1,214 @@
+/* Copyright (c) 2010-2013 by Intel Corp.
+
+   fastwalk is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public
+   License as published by the Free Software Foundation; version
+   2.
+
+   fastwalk is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should find a copy of v2 of the GNU General Public License somewhere
+   on your Linux system. */
+
+/* Just enough io_uring to batch system calls, without depending on
+   liburing. No SQPOLL, a single thread uses a ring. */
+#define _GNU_SOURCE 1
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include "uring.h"
+#include "stats.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			  unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+/* Returns 0 or -errno, for example -ENOSYS on old kernels */
+int uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+	int err;
+
+	memset(r, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(struct io_uring_params));
+	r->fd = io_uring_setup(entries, &p);
+	if (r->fd < 0)
+		return -errno;
+
+	r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_sz > r->sq_ring_sz)
+			r->sq_ring_sz = r->cq_ring_sz;
+		r->cq_ring_sz = 0;
+	}
+
+	sq = mmap(NULL, r->sq_ring_sz, PROT_READ|PROT_WRITE,
+		  MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+	r->sq_ring = sq;
+	if (r->cq_ring_sz) {
+		cq = mmap(NULL, r->cq_ring_sz, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto err;
+		r->cq_ring = cq;
+	} else {
+		cq = sq;
+	}
+
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto err;
+	}
+
+	r->sq_head = sq + p.sq_off.head;
+	r->sq_tail = sq + p.sq_off.tail;
+	r->sq_mask = sq + p.sq_off.ring_mask;
+	r->sq_array = sq + p.sq_off.array;
+	r->cq_head = cq + p.cq_off.head;
+	r->cq_tail = cq + p.cq_off.tail;
+	r->cq_mask = cq + p.cq_off.ring_mask;
+	r->cqes = cq + p.cq_off.cqes;
+	r->sq_entries = p.sq_entries;
+	r->sqe_tail = r->submitted = r->reaped = *r->sq_tail;
+	return 0;
+
+err:
+	err = -errno;
+	uring_exit(r);
+	return err;
+}
+
+void uring_exit(struct uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_sz);
+	if (r->cq_ring)
+		munmap(r->cq_ring, r->cq_ring_sz);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_ring_sz);
+	if (r->fd >= 0)
+		close(r->fd);
+	memset(r, 0, sizeof(struct uring));
+	r->fd = -1;
+}
+
+/* Returns NULL when the submission queue is full */
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned idx;
+	struct io_uring_sqe *sqe;
+
+	if (r->sqe_tail - head >= r->sq_entries)
+		return NULL;
+	idx = r->sqe_tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	r->sq_array[idx] = idx;
+	r->sqe_tail++;
+	return sqe;
+}
+
+/* Submit all prepared sqes and wait for wait_nr completions.
+   Returns the number submitted or -errno */
+int uring_submit(struct uring *r, unsigned wait_nr)
+{
+	unsigned n = r->sqe_tail - r->submitted;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	do {
+		stat_inc(ST_URING_ENTER);
+		ret = io_uring_enter(r->fd, n, wait_nr,
+				     wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	r->submitted += ret;
+	return ret;
+}
+
+int uring_wait_cqe(struct uring *r, struct io_uring_cqe **cqep)
+{
+	for (;;) {
+		unsigned head = *r->cq_head;
+		unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head != tail) {
+			*cqep = &r->cqes[head & *r->cq_mask];
+			return 0;
+		}
+		stat_inc(ST_URING_ENTER);
+		if (io_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+		    errno != EINTR)
+			return -errno;
+	}
+}
+
+void uring_cqe_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+	r->reaped++;
+}
+
+/* The next completion if there is one, without entering the kernel */
+static struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+	return head != tail ? &r->cqes[head & *r->cq_mask] : NULL;
+}
+
+/* Submit everything prepared and call done for each completion, 
+   until nothing is in flight anymore. The completions already in the
+   ring are reaped first, then a single io_uring_enter submits and
+   waits for all the others. Returns 0 or -errno. */
+int uring_submit_and_reap(struct uring *r,
+			  void (*done)(struct io_uring_cqe *, void *),
+			  void *arg)
+{
+	struct io_uring_cqe *cqe;
+	unsigned wait;
+	int ret;
+
+	for (;;) {
+		while ((cqe = uring_peek_cqe(r)) != NULL) {
+			done(cqe, arg);
+			uring_cqe_seen(r);
+		}
+		if (r->reaped == r->sqe_tail)
+			return 0;
+		/* Can't wait for more than fit into the completion ring */
+		wait = r->sqe_tail - r->reaped;
+		if (wait > *r->cq_mask + 1)
+			wait = *r->cq_mask + 1;
+		ret = uring_submit(r, wait);
+		if (ret < 0)
+			return ret;
+		if (ret == 0 && r->sqe_tail != r->submitted && 
+		    !uring_peek_cqe(r))
+			return -EAGAIN;
+	}
+}
@@ -0,0 +1,32 @@
+/* Minimal io_uring wrapper using the raw system calls. */
+#ifndef URING_H
+#define URING_H 1
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sq_entries;
+	unsigned sqe_tail;	/* next sqe to hand out */
+	unsigned submitted;	/* sqes passed to the kernel */
+	unsigned reaped;	/* completions consumed */
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+int uring_submit(struct uring *r, unsigned wait_nr);
+int uring_wait_cqe(struct uring *r, struct io_uring_cqe **cqep);
+void uring_cqe_seen(struct uring *r);
+int uring_submit_and_reap(struct uring *r,
+			  void (*done)(struct io_uring_cqe *, void *),
+			  void *arg);
+
+#endif